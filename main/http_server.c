@@ -254,6 +254,8 @@ static httpd_handle_t s_server = NULL;
 void start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.max_open_sockets = HTTP_SERVER_MAX_CLIENTS; /* lwIP sockets are shared with the Modbus gateway */
+    config.lru_purge_enable = true;
 
     const char *config_page_template = CONFIG_PAGE;
     char *config_page = esp32_malloc(strlen(config_page_template) + 128);
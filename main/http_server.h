@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#define HTTP_SERVER_MAX_CLIENTS 2 /* Open sockets, the oldest is purged for a new client */
+
 void start_webserver(void);
 void stop_webserver(void);
 
@@ -48,8 +48,12 @@
 #include "lcd204-i2c.hpp"
 //#include "sdmmc.h"
 
-#include "modbus_tcp_slave.h"
 #include "modbus_tcp2serial.h"
+#include "modbus_local.h"
+#include "modbus_bus.h"
+#include "modbus_cache.h"
+#include "modbus_rtu_master.h"
+#include "modbus_vmap.h"
 #include "modbus_data.h"
 
 #include <lwip/dns.h>
@@ -751,11 +755,230 @@ static void register_system()
 static int mbtcp(int argc, char** argv)
 {
     if(argc <= 1) {
+        static const char *class_str[MB_BUS_CLASS_MAX] = { "Write", "Priority", "Read", "Backgnd" };
+        mb_bus_stats_t stats;
+        for(int b=0; b<MB_BUS_MAX; b++) {
+            if(mb_bus_get_stats(b, &stats) != ESP_OK)
+                continue;
+            mb_serial_stats_t ss;
+            mb_serial_get_stats(stats.port, &ss);
+            printf("Bus %d (UART%d) : frames by length %u, by silence %u, timeouts %u, CRC errors %u\n", b, stats.port,
+                (unsigned)ss.by_length, (unsigned)ss.by_silence, (unsigned)ss.timeouts, (unsigned)ss.crc_errors);
+            for(int i=0; i<MB_BUS_CLASS_MAX; i++)
+                printf("  %-8s : queued %u, served %u, max wait %u ms\n", class_str[i],
+                    (unsigned)stats.queued[i], (unsigned)stats.served[i], (unsigned)stats.max_wait_ms[i]);
+            printf("  Coalesced reads : %u\n", (unsigned)stats.coalesced);
+            printf("  Deduplicated reads : %u\n", (unsigned)stats.deduplicated);
+            printf("  Fast failed requests : %u\n", (unsigned)stats.fast_failed);
+            printf("  Split reads : %u\n", (unsigned)stats.split);
+            printf("  Busy requests : rejected %u, expired %u\n", (unsigned)stats.rejected, (unsigned)stats.expired);
+            printf("  Service time : %u.%03u ms\n", (unsigned)(stats.service_us / 1000), (unsigned)(stats.service_us % 1000));
+        }
+        printf("Priority unit IDs :");
+        for(int i=0; i<256; i++) {
+            if(mb_bus_get_unit_priority(i))
+                printf(" %d", i);
+        }
+        printf("\n");
+        if(mb_bus_get_coalesce_gap() < 0)
+            printf("Coalesce gap : disable\n");
+        else
+            printf("Coalesce gap : %d registers\n", mb_bus_get_coalesce_gap());
+        if(mb_bus_get_queue_delay() == 0)
+            printf("Queue delay : disable\n");
+        else
+            printf("Queue delay : %u ms\n", mb_bus_get_queue_delay());
         return 0;
     }
  
-    if(strcasecmp(argv[1], "id") == 0) {
-    }
+    if(strcasecmp(argv[1], "priority") == 0) {
+        if(argc >= 4) {
+            uint8_t uid = atoi(argv[2]);
+            if(strcmp(argv[3], "enable") == 0)
+                mb_bus_set_unit_priority(uid, true);
+            else
+                mb_bus_set_unit_priority(uid, false);
+        } else if(argc >= 3) {
+            uint8_t uid = atoi(argv[2]);
+            printf("Unit %u priority : %s\n", uid, mb_bus_get_unit_priority(uid) ? "enable" : "disable");
+        }
+    } else if(strcasecmp(argv[1], "units") == 0) {
+        static const char *state_str[] = { "online", "offline", "probing" };
+        mb_bus_unit_t u;
+        for(int b=0; b<MB_BUS_MAX; b++) {
+            for(int i=1; i<256; i++) {
+                if(mb_bus_get_unit(b, i, &u) == false)
+                    continue;
+                unsigned max_regs = mb_bus_get_max_regs(b, i) ? mb_bus_get_max_regs(b, i) : 125;
+                bool learned = (u.learned_regs != 0 && u.learned_regs < max_regs);
+                printf("Bus %d unit %3d : %-7s, srtt %u.%03u ms, rttvar %u.%03u ms, timeout %u ms, timeouts %u, max regs %u%s\n", b, i,
+                    state_str[u.state], (unsigned)(u.srtt_us / 1000), (unsigned)(u.srtt_us % 1000),
+                    (unsigned)(u.rttvar_us / 1000), (unsigned)(u.rttvar_us % 1000),
+                    (unsigned)u.timeout_ms, (unsigned)u.total_timeouts,
+                    learned ? u.learned_regs : max_regs, learned ? " (learned)" : "");
+            }
+        }
+    } else if(strcasecmp(argv[1], "reset") == 0 && argc >= 4) {
+        mb_bus_reset_unit(atoi(argv[2]), atoi(argv[3]));
+    } else if(strcasecmp(argv[1], "maxregs") == 0 && argc >= 4) {
+        uint8_t bus = atoi(argv[2]);
+        uint8_t addr = atoi(argv[3]);
+        if(argc >= 5)
+            mb_bus_set_max_regs(bus, addr, atoi(argv[4]));
+        printf("Bus %d unit %d : %u registers per read\n", bus, addr,
+            mb_bus_get_max_regs(bus, addr) ? mb_bus_get_max_regs(bus, addr) : 125);
+    } else if(strcasecmp(argv[1], "line") == 0 && argc >= 3) {
+        static const char parity_str[] = { 'N', '?', 'E', 'O' };
+        uint8_t bus = atoi(argv[2]);
+        mb_serial_line_t line;
+        if(mb_bus_get_line(bus, &line) != ESP_OK) {
+            printf("Bus %d not enabled !!!\n", bus);
+            return 0;
+        }
+        if(argc >= 5 && strcasecmp(argv[3], "auto") == 0) {
+            printf("Probing unit %d on bus %d ...\n", atoi(argv[4]), bus);
+            if(mb_bus_autobaud(bus, atoi(argv[4]), &line) != ESP_OK) {
+                printf("No answer, line unchanged !!!\n");
+                return 0;
+            }
+        } else if(argc >= 4) {
+            line.baudrate = atoi(argv[3]);
+            if(argc >= 5) {
+                if(strcasecmp(argv[4], "N") == 0)
+                    line.parity = UART_PARITY_DISABLE;
+                else if(strcasecmp(argv[4], "O") == 0)
+                    line.parity = UART_PARITY_ODD;
+                else
+                    line.parity = UART_PARITY_EVEN;
+            }
+            if(argc >= 6)
+                line.stop_bits = (atoi(argv[5]) == 2) ? UART_STOP_BITS_2 : UART_STOP_BITS_1;
+            if(mb_bus_set_line(bus, &line) != ESP_OK) {
+                printf("Invalid line setting !!!\n");
+                return 0;
+            }
+        }
+        printf("Bus %d : %d %c %d\n", bus, line.baudrate, parity_str[line.parity & 3],
+            line.stop_bits == UART_STOP_BITS_2 ? 2 : 1);
+    } else if(strcasecmp(argv[1], "route") == 0) {
+        mb_bus_route_t r;
+        if(argc >= 4) {
+            uint8_t uid = atoi(argv[2]);
+            uint8_t bus = atoi(argv[3]);
+            if(mb_bus_is_started(bus) == false)
+                printf("Bus %d not enabled !!!\n", bus);
+            else
+                mb_bus_set_route(uid, bus, argc >= 5 ? atoi(argv[4]) : uid);
+        } else {
+            for(int i=0; i<256; i++) {
+                mb_bus_get_route(i, &r);
+                if(r.bus != 0 || r.addr != i)
+                    printf("Unit %3d -> bus %u address %u\n", i, r.bus, r.addr);
+            }
+        }
+    } else if(strcasecmp(argv[1], "coalesce") == 0) {
+        if(argc >= 3) {
+            if(strcmp(argv[2], "disable") == 0)
+                mb_bus_set_coalesce_gap(-1);
+            else
+                mb_bus_set_coalesce_gap(atoi(argv[2]));
+        } else
+            printf("Coalesce gap : %d\n", mb_bus_get_coalesce_gap());
+    } else if(strcasecmp(argv[1], "limit") == 0) {
+        mb_tcp_limits_t l;
+        mb_tcp2serial_get_limits(&l);
+        if(argc >= 5 && strcasecmp(argv[2], "conn") == 0) {
+            l.conn_rps = atoi(argv[3]);
+            l.conn_bus_ms = atoi(argv[4]);
+        } else if(argc >= 5 && strcasecmp(argv[2], "ip") == 0) {
+            l.ip_rps = atoi(argv[3]);
+            l.ip_bus_ms = atoi(argv[4]);
+        } else if(argc >= 4 && strcasecmp(argv[2], "policy") == 0) {
+            l.reject = (strcmp(argv[3], "reject") == 0);
+        }
+        mb_tcp2serial_set_limits(&l);
+        printf("Connection limit : %u requests/s, %u bus ms/s\n", l.conn_rps, l.conn_bus_ms);
+        printf("Address limit : %u requests/s, %u bus ms/s\n", l.ip_rps, l.ip_bus_ms);
+        printf("Over limit : %s\n", l.reject ? "reject" : "delay");
+    } else if(strcasecmp(argv[1], "clients") == 0) {
+        mb_tcp_client_t c;
+        for(int i=0; i<CONFIG_MB_GATEWAY_MAX_CONNECTIONS; i++) {
+            if(mb_tcp2serial_get_client(i, &c))
+                printf("%2d : %s%s, requests %u, throttled %u (address %u), idle %u ms, output %u bytes\n", i, c.addr_str,
+                    c.rtu ? " (RTU)" : "", (unsigned)c.requests, (unsigned)c.throttled, (unsigned)c.addr_throttled, (unsigned)c.idle_ms,
+                    (unsigned)c.tx_queued);
+        }
+        printf("Slow consumers dropped : %u\n", (unsigned)mb_tcp2serial_get_slow_drops());
+        mb_udp_stats_t u;
+        mb_tcp2serial_get_udp_stats(&u);
+        printf("UDP : requests %u, duplicates %u, dropped %u, throttled %u, invalid %u, send errors %u\n", (unsigned)u.requests,
+            (unsigned)u.duplicates, (unsigned)u.dropped, (unsigned)u.throttled, (unsigned)u.invalid, (unsigned)u.send_errors);
+    } else if(strcasecmp(argv[1], "local") == 0) {
+        if(argc >= 3) {
+            if(strcmp(argv[2], "disable") == 0)
+                mb_local_set_uid(MB_LOCAL_UID_DISABLE);
+            else
+                mb_local_set_uid(atoi(argv[2]));
+        }
+        if(mb_local_get_uid() == MB_LOCAL_UID_DISABLE)
+            printf("Local unit ID : disable\n");
+        else
+            printf("Local unit ID : %u\n", mb_local_get_uid());
+    } else if(strcasecmp(argv[1], "pool") == 0) {
+        mb_tcp_pool_t p;
+        mb_tcp2serial_get_pool(&p);
+        printf("Connections : %u / %u, peak %u\n", p.conns_used, p.conns, p.conns_peak);
+        printf("Frames : %u / %u, peak %u, waits %u\n", p.frames_used, p.frames, p.frames_peak, (unsigned)p.frame_waits);
+        printf("Memory : %u bytes in %s\n", (unsigned)p.bytes, p.psram ? "PSRAM" : "internal RAM");
+        printf("Stack : %u bytes never used\n", (unsigned)p.stack_free);
+    } else if(strcasecmp(argv[1], "delay") == 0) {
+        if(argc >= 3) {
+            if(strcmp(argv[2], "disable") == 0)
+                mb_bus_set_queue_delay(0);
+            else
+                mb_bus_set_queue_delay(atoi(argv[2]));
+        } else
+            printf("Queue delay : %u ms\n", mb_bus_get_queue_delay());
+    } else if(strcasecmp(argv[1], "cache") == 0) {
+        if(argc <= 2) {
+            mb_cache_stats_t stats;
+            mb_cache_get_stats(&stats);
+            printf("Cache : hits %u, misses %u, stores %u, invalidations %u\n",
+                (unsigned)stats.hits, (unsigned)stats.misses, (unsigned)stats.stores, (unsigned)stats.invalidations);
+            printf("Default TTL : %d ms\n", CONFIG_MB_GATEWAY_CACHE_TTL_MS);
+            for(int i=1; i<256; i++) {
+                if(mb_cache_get_unit_ttl(i) != CONFIG_MB_GATEWAY_CACHE_TTL_MS)
+                    printf("Unit %d TTL : %u ms\n", i, mb_cache_get_unit_ttl(i));
+            }
+            for(int i=0; i<MB_CACHE_MAX_RULES; i++) {
+                const mb_cache_rule_t *r = mb_cache_get_rule(i);
+                if(r)
+                    printf("Unit %u FC%u %u - %u TTL : %u ms\n", r->uid, r->function,
+                        r->start, r->start + r->count - 1, r->ttl_ms);
+            }
+        } else if(strcasecmp(argv[2], "ttl") == 0 && argc >= 5) {
+            mb_cache_set_unit_ttl(atoi(argv[3]), atoi(argv[4]));
+        } else if(strcasecmp(argv[2], "range") == 0 && argc >= 8) {
+            mb_cache_rule_t r;
+            r.uid = atoi(argv[3]);
+            r.function = atoi(argv[4]);
+            r.start = atoi(argv[5]);
+            r.count = atoi(argv[6]);
+            r.ttl_ms = atoi(argv[7]);
+            if(mb_cache_set_rule(&r) != ESP_OK)
+                printf("Invalid or too many rules !!!\n");
+        } else if(strcasecmp(argv[2], "clear") == 0) {
+            mb_cache_clear();
+        } else
+            printf("Unknown command !!!\n");
+    } else if(strcasecmp(argv[1], "save") == 0) {
+        mb_bus_save_config();
+        mb_cache_save_config();
+        mb_tcp2serial_save_config();
+        mb_local_save_config();
+        printf("Modbus gateway config saved ...\n");
+    } else
+        printf("Unknown command !!!\n");
 
     return 0;
 }
@@ -764,7 +987,7 @@ static void register_mbtcp()
 {
     const esp_console_cmd_t cmd = {
         .command = "mbtcp",
-        .help = "mbtcp [ hostname ] <string>",
+        .help = "mbtcp [ priority <unit id> <enable | disable> | local [ <unit id> | disable ] | units | reset <bus> <address> | maxregs <bus> <address> [count] | route [ <unit id> <bus> [address] ] | line <bus> [ <baud> [N|E|O] [1|2] | auto <address> ] | coalesce <gap | disable> | delay <ms | disable> | limit [ conn | ip <req/s> <bus ms/s> | policy <delay | reject> ] | clients | pool | cache [ ttl <unit id> <ms> | range <unit id> <fc> <start> <count> <ms> | clear ] | save ]",
         .hint = NULL,
         .func = &mbtcp,
         .argtable = NULL,
@@ -772,6 +995,128 @@ static void register_mbtcp()
     ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
 }
 
+static int mbscan(int argc, char** argv)
+{
+    if(argc <= 1) {
+        mb_scan_stats_t stats;
+        mb_scan_get_stats(&stats);
+        printf("Scan : polls %u, errors %u, late %u, shadow hits %u\n",
+            (unsigned)stats.polls, (unsigned)stats.errors, (unsigned)stats.late, (unsigned)stats.hits);
+        printf("Bus budget : %u %%\n", mb_scan_get_budget());
+        for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+            const mb_scan_entry_t *e = mb_scan_get_entry(i);
+            if(e)
+                printf("%2d : unit %u FC%u %u - %u every %u ms (now %u ms)\n", i, e->uid, e->function,
+                    e->start, e->start + e->count - 1, (unsigned)e->interval_ms, (unsigned)mb_scan_get_period(i));
+        }
+        return 0;
+    }
+
+    if(strcasecmp(argv[1], "add") == 0 && argc >= 7) {
+        mb_scan_entry_t e;
+        e.uid = atoi(argv[2]);
+        e.function = atoi(argv[3]);
+        e.start = atoi(argv[4]);
+        e.count = atoi(argv[5]);
+        e.interval_ms = atoi(argv[6]);
+        int i;
+        for(i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+            if(mb_scan_get_entry(i) == NULL)
+                break;
+        }
+        if(i == MB_SCAN_MAX_ENTRIES || e.interval_ms == 0 || mb_scan_set_entry(i, &e) != ESP_OK)
+            printf("Invalid or too many scan entries !!!\n");
+        else
+            printf("Scan entry %d added ...\n", i);
+    } else if(strcasecmp(argv[1], "del") == 0 && argc >= 3) {
+        mb_scan_entry_t e = { 0 };
+        if(mb_scan_set_entry(atoi(argv[2]), &e) != ESP_OK)
+            printf("Invalid index !!!\n");
+    } else if(strcasecmp(argv[1], "budget") == 0) {
+        if(argc >= 3) {
+            if(mb_scan_set_budget(atoi(argv[2])) != ESP_OK)
+                printf("Budget out of range 1 - 100 !!!\n");
+        } else
+            printf("Bus budget : %u %%\n", mb_scan_get_budget());
+    } else if(strcasecmp(argv[1], "save") == 0) {
+        mb_scan_save_config();
+        printf("Modbus scan list saved ...\n");
+    } else
+        printf("Unknown command !!!\n");
+
+    return 0;
+}
+
+static void register_mbscan()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "mbscan",
+        .help = "mbscan [ add <unit id> <fc> <start> <count> <ms> | del <index> | budget <percent> | save ]",
+        .hint = NULL,
+        .func = &mbscan,
+        .argtable = NULL,
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static int mbvmap(int argc, char** argv)
+{
+    if(argc <= 1) {
+        mb_vmap_stats_t stats;
+        mb_vmap_get_stats(&stats);
+        printf("Virtual reads : %u, parts %u, busy %u\n",
+            (unsigned)stats.requests, (unsigned)stats.parts, (unsigned)stats.busy);
+        for(int i=0; i<MB_VMAP_MAX_RULES; i++) {
+            const mb_vmap_rule_t *r = mb_vmap_get_rule(i);
+            if(r)
+                printf("%2d : unit %u FC%u %u - %u <- unit %u %u - %u\n", i, r->vuid, r->function,
+                    r->vstart, r->vstart + r->count - 1, r->uid, r->start, r->start + r->count - 1);
+        }
+        return 0;
+    }
+
+    if(strcasecmp(argv[1], "add") == 0 && argc >= 8) {
+        mb_vmap_rule_t r;
+        r.vuid = atoi(argv[2]);
+        r.function = atoi(argv[3]);
+        r.vstart = atoi(argv[4]);
+        r.count = atoi(argv[5]);
+        r.uid = atoi(argv[6]);
+        r.start = atoi(argv[7]);
+        int i;
+        for(i=0; i<MB_VMAP_MAX_RULES; i++) {
+            if(mb_vmap_get_rule(i) == NULL)
+                break;
+        }
+        if(i == MB_VMAP_MAX_RULES || r.vuid == 0 || mb_vmap_set_rule(i, &r) != ESP_OK)
+            printf("Invalid or too many rules !!!\n");
+        else
+            printf("Rule %d added ...\n", i);
+    } else if(strcasecmp(argv[1], "del") == 0 && argc >= 3) {
+        mb_vmap_rule_t r = { 0 };
+        if(mb_vmap_set_rule(atoi(argv[2]), &r) != ESP_OK)
+            printf("Invalid index !!!\n");
+    } else if(strcasecmp(argv[1], "save") == 0) {
+        mb_vmap_save_config();
+        printf("Modbus virtual unit map saved ...\n");
+    } else
+        printf("Unknown command !!!\n");
+
+    return 0;
+}
+
+static void register_mbvmap()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "mbvmap",
+        .help = "mbvmap [ add <virtual unit id> <fc> <virtual start> <count> <unit id> <start> | del <index> | save ]",
+        .hint = NULL,
+        .func = &mbvmap,
+        .argtable = NULL,
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
 static void initialize_console()
 {
     /* Drain stdout before reconfiguring it */
@@ -852,6 +1197,8 @@ void consoleTask(void *pvParameters){
     register_eth();
     register_ping();
     register_mbtcp();
+    register_mbscan();
+    register_mbvmap();
     register_system();
 
     /* Prompt to be printed before each line.
@@ -1436,12 +1783,16 @@ extern "C" void app_main(void)
     initialize_ext_gpio();
     xTaskCreatePinnedToCore(&extGpioTask, "extGpioTask", 4096, NULL, 4, NULL, 1);
 
-    xTaskCreatePinnedToCore(&mbTcpSlaveTask, "mbTcpSlaveTask", 8192, semWriteExtGpio, 5, NULL, 0);
-    //xTaskCreatePinnedToCore(&mbRtuMasterTask, "mbRtuMasterTask", 8192, NULL, 5, NULL, 0);
+    /* Served on the gateway port, for the local unit ID */
+    mb_local_init(semWriteExtGpio);
+
+    /* RS485 9600 8E1, shared by the gateway and the background poller */
+    initialize_modbus_bus();
 
-    /* RS485 9600 8E1 */
+    initialize_modbus_rtu_master(); /* Before the gateway and the console look into the shadow map */
     initialize_modbus_tcp2serial();
-    xTaskCreatePinnedToCore(&mbTcp2Serial_task, "mbTcp2Serial_task", 3072, NULL, 4, NULL, 0);
+    xTaskCreatePinnedToCore(&mbTcp2Serial_task, "mbTcp2Serial_task", 4096, NULL, 4, NULL, 0);
+    xTaskCreatePinnedToCore(&mbRtuMasterTask, "mbRtuMasterTask", 4096, NULL, 4, NULL, 0);
 
     xTaskCreatePinnedToCore(&consoleTask, "consoleTask", 3072, NULL, 3, NULL, 1);
     xTaskCreatePinnedToCore(&telnetdTask, "telnetdTask", 4096, NULL, 2, NULL, 1);
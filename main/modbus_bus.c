@@ -0,0 +1,1227 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "sdkconfig.h"
+
+#include "modbus_serial.h"
+#include "modbus_bus.h"
+#include "modbus_cache.h"
+#include "modbus_rtu_master.h"
+#include "modbus_vmap.h"
+
+static const char *TAG = "mb_bus";
+
+#define MB_PORT_NUM     (CONFIG_MB_UART_PORT_NUM)   // Number of UART port used for Modbus connection
+#define MB_DEV_SPEED    (CONFIG_MB_UART_BAUD_RATE)  // The communication speed of the UART
+
+// Function code
+#define MB_FUNC_READ_COILS 1
+#define MB_FUNC_READ_DISCRETE_INPUTS 2
+#define MB_FUNC_READ_HOLDING_REGISTERS 3
+#define MB_FUNC_READ_INPUT_REGISTER 4
+
+#define MB_FUNC_WRITE_SINGLE_COIL 5
+#define MB_FUNC_WRITE_SINGLE_REGISTER 6
+#define MB_FUNC_WRITE_MULTIPLE_COILS 15
+#define MB_FUNC_WRITE_MULTIPLE_REGISTERS 16
+#define MB_FUNC_MASK_WRITE_REGISTER 22
+#define MB_FUNC_READWRITE_MULTIPLE_REGISTERS 23
+
+// Exception code
+#define MB_EX_ILLEGAL_DATA_ADDRESS 0x02
+#define MB_EX_ILLEGAL_DATA_VALUE 0x03
+#define MB_EX_SLAVE_DEVICE_BUSY 0x06
+#define MB_EX_GATEWAY_PATH_UNAVAILABLE 0x0A
+#define MB_EX_GATEWAY_TARGET_FAILED 0x0B
+
+#define MB_READ_REGS_MAX 125
+
+//
+// RS485 bus scheduler : one queue per class, each kept sorted by virtual
+// start time (start-time fair queuing). A client's transactions are spaced
+// by cost / weight in virtual time, so a chatty client only delays itself.
+//
+#define WFQ_OVERHEAD_BYTES 8 // Address, CRC and line turnaround, in bytes
+
+static uint8_t s_unit_prio[256 / 8]; // Bitmap of priority unit IDs
+
+//
+// Admission control : a client request is refused with 0x06 when the
+// transactions served before it would take longer than s_queue_delay_ms at
+// the bus's average service time, and dropped with 0x06 if it still waited
+// that long. Background polls are exempt, nobody times out on them.
+//
+static uint16_t s_queue_delay_ms = CONFIG_MB_GATEWAY_QUEUE_DELAY_MS; // 0 disables
+
+//
+// Read coalescing : queued FC3 / FC4 reads of the same unit whose ranges
+// overlap or lie within s_coalesce_gap registers of each other are merged
+// into one read of at most 125 registers, then split back per request.
+//
+static int16_t s_coalesce_gap = CONFIG_MB_GATEWAY_COALESCE_GAP; // -1 disables
+
+//
+// Read splitting : an FC3 / FC4 read above the registers a unit takes per
+// request goes out as several reads, answered as one. The limit is set from
+// the console, or learned when the unit refuses a quantity with exception 03
+// and takes half of it. A learned limit lives in RAM only, and is doubled
+// back after LEARNED_REGS_RECOVER reads so a unit that was merely busy gets
+// its full reads again.
+//
+#define LEARNED_REGS_RECOVER 64
+
+static uint8_t s_max_regs[MB_BUS_MAX][256]; // By address on each bus, 0 is MB_READ_REGS_MAX
+
+//
+// Per unit health : the response timeout follows the measured turnaround
+// (srtt + 4 * rttvar, as TCP does) instead of the global worst case, and a
+// unit missing CONFIG_MB_GATEWAY_BREAKER_FAILURES answers in a row is taken
+// offline. Its requests then fail fast with 0x0B, one probe per backoff
+// period decides when it is back.
+//
+#define UNIT_MIN_SAMPLES 4 // Turnaround samples before the timeout adapts
+#define UNIT_TIMEOUT_MAX_MS CONFIG_FMB_MASTER_TIMEOUT_MS_RESPOND
+#define UNIT_BACKOFF_MAX_MS 60000
+#define UNIT_BACKOFF_SHIFT_MAX 4 // Timeout doubles at most this many times after consecutive misses
+
+//
+// One bus per RS485 port, each with its own queues and worker task. The
+// route table maps the unit ID of a request to a bus and to the address of
+// the slave on that bus.
+//
+typedef struct {
+    bool started;
+    uart_port_t port;
+    mb_bus_txn_t *queue[MB_BUS_CLASS_MAX];
+    mb_bus_txn_t *inflight; // Transactions on the wire, chained by next
+    uint32_t service_us; // Average time of one bus task round, used by admission control
+    uint32_t vtime; // Virtual start time of the transaction in service
+    xSemaphoreHandle mutex;
+    xSemaphoreHandle count;
+    xSemaphoreHandle wire; // Held for each transaction, line changes wait for it
+    mb_bus_stats_t stats;
+    mb_bus_txn_t group_txn; // Merged request, only used by the bus task
+    mb_bus_txn_t split_txn; // Part of a split read, only used by the bus task
+    mb_bus_unit_t units[256]; // By address on this bus
+} mb_bus_t;
+
+static EXT_RAM_BSS_ATTR mb_bus_t s_buses[MB_BUS_MAX];
+
+static mb_bus_route_t s_routes[256];
+
+//
+// Write generations : bumped by every write to a slave, and for each unit ID
+// whenever its route changes. Several unit IDs may lead to the same slave, a
+// read is stamped with the sum of its slave's, its bus broadcast's and its
+// unit ID's counters. They only grow, the sum moves when any of them does.
+//
+static volatile uint32_t s_write_gen[MB_BUS_MAX][256]; // By address on each bus
+static volatile uint32_t s_route_gen[256]; // By unit ID as addressed by the clients
+
+static inline uint32_t _gen(uint8_t uid, uint8_t bus, uint8_t addr)
+{
+    return s_write_gen[bus][addr] + s_write_gen[bus][0] + s_route_gen[uid];
+}
+
+/* Cache and shadow entries of every unit ID routed to the slave written, all of the bus for a broadcast */
+static void _invalidate_routed(uint8_t bus, uint8_t addr, const uint8_t *req, uint16_t req_len)
+{
+    for(int uid=0; uid<256; uid++) {
+        if(s_routes[uid].bus != bus || (addr != 0 && s_routes[uid].addr != addr))
+            continue;
+        mb_cache_invalidate(uid, req, req_len);
+        mb_scan_invalidate(uid, req, req_len);
+    }
+}
+
+static mb_serial_line_t s_lines[MB_BUS_MAX]; // Saved line settings, baudrate 0 keeps the Kconfig ones
+
+//
+// Line auto detection : a known slave is probed from the fastest baudrate
+// down, under each common framing, until it answers twice in a row.
+//
+#define AUTOBAUD_PROBE_TIMEOUT_MS 200
+
+static const int s_autobaud_rates[] = { 115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200 };
+static const struct {
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+} s_autobaud_framings[] = {
+    { UART_PARITY_EVEN, UART_STOP_BITS_1 }, /* Modbus default */
+    { UART_PARITY_DISABLE, UART_STOP_BITS_2 }, /* Modbus no parity */
+    { UART_PARITY_ODD, UART_STOP_BITS_1 },
+    { UART_PARITY_DISABLE, UART_STOP_BITS_1 }, /* Common, not compliant */
+};
+
+static inline bool _is_write(uint8_t function)
+{
+    switch(function) {
+        case MB_FUNC_WRITE_SINGLE_COIL:
+        case MB_FUNC_WRITE_SINGLE_REGISTER:
+        case MB_FUNC_WRITE_MULTIPLE_COILS:
+        case MB_FUNC_WRITE_MULTIPLE_REGISTERS:
+        case MB_FUNC_MASK_WRITE_REGISTER:
+        case MB_FUNC_READWRITE_MULTIPLE_REGISTERS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Bytes on the wire of the answer to a request, echo sized when unknown */
+static uint32_t _answer_bytes(const uint8_t *pdu, uint16_t pdu_len)
+{
+    uint16_t count = (pdu_len >= 5) ? (pdu[3] << 8) + pdu[4] : 0;
+
+    switch(pdu[0]) {
+        case MB_FUNC_READ_COILS:
+        case MB_FUNC_READ_DISCRETE_INPUTS:
+            return WFQ_OVERHEAD_BYTES + 2 + (count + 7) / 8;
+        case MB_FUNC_READ_HOLDING_REGISTERS:
+        case MB_FUNC_READ_INPUT_REGISTER:
+            return WFQ_OVERHEAD_BYTES + 2 + count * 2;
+        default:
+            return WFQ_OVERHEAD_BYTES + pdu_len;
+    }
+}
+
+/* Bytes on the wire for request and response, the unit of fair queuing */
+static uint32_t _pdu_cost(const uint8_t *pdu, uint16_t pdu_len)
+{
+    return WFQ_OVERHEAD_BYTES + pdu_len + _answer_bytes(pdu, pdu_len);
+}
+
+static inline uint32_t _txn_cost(const mb_bus_txn_t *t)
+{
+    return _pdu_cost(t->pdu, t->pdu_len);
+}
+
+void mb_bus_client_init(mb_bus_client_t *c, uint16_t weight)
+{
+    c->weight = weight > 0 ? weight : 1;
+    for(int i=0; i<MB_BUS_MAX; i++)
+        c->finish[i] = 0;
+}
+
+static inline bool _unit_is_offline(const mb_bus_unit_t *u, uint32_t now)
+{
+    return u->state == MB_UNIT_OFFLINE && (int32_t)(now - u->retry_tick) < 0;
+}
+
+static inline void _exception(mb_bus_txn_t *t, uint8_t code)
+{
+    t->pdu[0] |= 0x80;
+    t->pdu[1] = code;
+    t->pdu_len = 2;
+}
+
+/* Called with the queue locked */
+static void _fail_fast(mb_bus_t *b, mb_bus_txn_t *t)
+{
+    _exception(t, MB_EX_GATEWAY_TARGET_FAILED);
+    b->stats.fast_failed++;
+}
+
+/* Called with the queue locked */
+static void _busy(mb_bus_t *b, mb_bus_txn_t *t, bool queued)
+{
+    _exception(t, MB_EX_SLAVE_DEVICE_BUSY);
+    if(queued)
+        b->stats.expired++;
+    else
+        b->stats.rejected++;
+}
+
+static inline bool _is_expired(const mb_bus_txn_t *t, uint32_t now)
+{
+    return s_queue_delay_ms != 0 && t->cls != MB_BUS_CLASS_BACKGROUND &&
+        (now - t->queued_tick) * portTICK_PERIOD_MS > s_queue_delay_ms;
+}
+
+/* Transactions served before one tagged tag in class cls, called with the queue locked */
+static uint32_t _bus_ahead(mb_bus_t *b, uint8_t cls, uint32_t tag)
+{
+    uint32_t ahead = 0;
+
+    for(mb_bus_txn_t *q = b->inflight; q; q = q->next)
+        ahead++;
+    for(int i=0; i<cls; i++)
+        ahead += b->stats.queued[i];
+    for(mb_bus_txn_t *q = b->queue[cls]; q && (int32_t)(q->tag - tag) <= 0; q = q->next)
+        ahead++;
+
+    return ahead;
+}
+
+static inline bool _is_read(const mb_bus_txn_t *t)
+{
+    return t->req_len == 5 && t->req[0] >= MB_FUNC_READ_COILS && t->req[0] <= MB_FUNC_READ_INPUT_REGISTER;
+}
+
+/*
+ * Identical read already queued or on the wire, called with the queue locked.
+ * Client reads never wait on a queued background read, it could be served last.
+ */
+static mb_bus_txn_t *_bus_find_twin(mb_bus_t *b, const mb_bus_txn_t *t)
+{
+    mb_bus_txn_t *heads[] = { b->inflight, b->queue[MB_BUS_CLASS_PRIORITY], b->queue[MB_BUS_CLASS_READ],
+        (t->cls == MB_BUS_CLASS_BACKGROUND) ? b->queue[MB_BUS_CLASS_BACKGROUND] : NULL };
+
+    for(int i=0; i<sizeof(heads) / sizeof(heads[0]); i++) {
+        for(mb_bus_txn_t *q = heads[i]; q; q = q->next) {
+            if(q->uid == t->uid && q->gen == t->gen && q->req_len == t->req_len && memcmp(q->req, t->req, t->req_len) == 0)
+                return q;
+        }
+    }
+
+    return NULL;
+}
+
+void mb_bus_submit(mb_bus_txn_t *t)
+{
+    if(mb_vmap_submit(t)) /* Served by reads to the real units */
+        return;
+
+    t->followers = NULL;
+    t->req_len = t->pdu_len;
+    memcpy(t->req, t->pdu, t->req_len < sizeof(t->req) ? t->req_len : sizeof(t->req));
+
+    t->bus = s_routes[t->uid].bus;
+    t->addr = s_routes[t->uid].addr;
+    if(t->bus >= MB_BUS_MAX || s_buses[t->bus].started == false) {
+        _exception(t, MB_EX_GATEWAY_PATH_UNAVAILABLE);
+        t->done(t);
+        return;
+    }
+
+    mb_bus_t *b = &s_buses[t->bus];
+    t->gen = _gen(t->uid, t->bus, t->addr);
+
+    if(_is_write(t->pdu[0])) {
+        t->cls = MB_BUS_CLASS_WRITE;
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        s_write_gen[t->bus][t->addr]++; /* Reads already queued or on the wire are neither cached nor shared from now on */
+        xSemaphoreGive(b->mutex);
+        /* Reads submitted from now on must not see the old values, through any unit ID */
+        _invalidate_routed(t->bus, t->addr, t->pdu, t->pdu_len);
+    } else if((t->flags & MB_BUS_TXN_FRESH) == 0 &&
+        (mb_scan_lookup(t->uid, t->pdu, t->pdu_len, t->pdu, &t->pdu_len) ||
+         mb_cache_lookup(t->uid, t->pdu, t->pdu_len, t->pdu, &t->pdu_len))) {
+        t->done(t); /* Served from the shadow map or the cache, the bus is not involved */
+        return;
+    } else if(t->flags & MB_BUS_TXN_BACKGROUND)
+        t->cls = MB_BUS_CLASS_BACKGROUND;
+    else if(mb_bus_get_unit_priority(t->uid))
+        t->cls = MB_BUS_CLASS_PRIORITY;
+    else
+        t->cls = MB_BUS_CLASS_READ;
+
+    t->queued_tick = xTaskGetTickCount();
+
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+
+    if(_unit_is_offline(&b->units[t->addr], t->queued_tick)) {
+        _fail_fast(b, t);
+        xSemaphoreGive(b->mutex);
+        t->done(t);
+        return;
+    }
+
+    if(_is_read(t)) {
+        mb_bus_txn_t *twin = _bus_find_twin(b, t);
+        if(twin) { /* Single flight : ride along, no bus time is charged */
+            t->next = twin->followers;
+            twin->followers = t;
+            b->stats.deduplicated++;
+            xSemaphoreGive(b->mutex);
+            return;
+        }
+    }
+
+    mb_bus_client_t *c = t->client;
+    uint32_t start = b->vtime;
+    if(c && (int32_t)(c->finish[t->bus] - start) > 0)
+        start = c->finish[t->bus];
+
+    if(s_queue_delay_ms != 0 && t->cls != MB_BUS_CLASS_BACKGROUND &&
+        _bus_ahead(b, t->cls, start) * b->service_us / 1000 > s_queue_delay_ms) {
+        _busy(b, t, false);
+        xSemaphoreGive(b->mutex);
+        t->done(t);
+        return;
+    }
+
+    if(c)
+        c->finish[t->bus] = start + _txn_cost(t) * 16 / c->weight;
+    t->tag = start;
+
+    /* Insert sorted by tag, after any equal tag so a client stays FIFO */
+    mb_bus_txn_t **pp = &b->queue[t->cls];
+    while(*pp && (int32_t)((*pp)->tag - t->tag) <= 0)
+        pp = &(*pp)->next;
+    t->next = *pp;
+    *pp = t;
+
+    b->stats.queued[t->cls]++;
+
+    xSemaphoreGive(b->mutex);
+
+    xSemaphoreGive(b->count);
+}
+
+uint32_t mb_bus_write_gen(uint8_t uid)
+{
+    mb_bus_route_t r = s_routes[uid];
+    return r.bus < MB_BUS_MAX ? _gen(uid, r.bus, r.addr) : s_route_gen[uid];
+}
+
+static bool _read_range(const mb_bus_txn_t *t, uint16_t *start, uint16_t *count)
+{
+    if(t->pdu_len != 5 || (t->pdu[0] != MB_FUNC_READ_HOLDING_REGISTERS && t->pdu[0] != MB_FUNC_READ_INPUT_REGISTER))
+        return false;
+
+    *start = (t->pdu[1] << 8) + t->pdu[2];
+    *count = (t->pdu[3] << 8) + t->pdu[4];
+
+    return *count >= 1 && *count <= MB_READ_REGS_MAX;
+}
+
+/* Chains queued reads that can share the wire with t behind t->next, called with the queue locked */
+static void _bus_coalesce(mb_bus_t *b, mb_bus_txn_t *t)
+{
+    uint16_t s, n;
+
+    if(s_coalesce_gap < 0 || _read_range(t, &s, &n) == false)
+        return;
+
+    uint32_t lo = s, hi = s + n;
+    mb_bus_txn_t *tail = t;
+    bool merged = true;
+
+    while(merged) { /* A merge may bring other requests within reach */
+        merged = false;
+        for(int i=MB_BUS_CLASS_PRIORITY; i<=MB_BUS_CLASS_BACKGROUND; i++) {
+            mb_bus_txn_t **pp = &b->queue[i];
+            while(*pp) {
+                mb_bus_txn_t *q = *pp;
+                if(q->uid == t->uid && q->pdu[0] == t->pdu[0] && _read_range(q, &s, &n) &&
+                    s <= hi + s_coalesce_gap && s + n + s_coalesce_gap >= lo) {
+                    uint32_t l = s < lo ? s : lo;
+                    uint32_t h = s + n > hi ? s + n : hi;
+                    if(h - l <= MB_READ_REGS_MAX) {
+                        *pp = q->next;
+                        q->next = NULL;
+                        tail->next = q;
+                        tail = q;
+                        lo = l;
+                        hi = h;
+                        b->stats.queued[i]--;
+                        b->stats.coalesced++;
+                        merged = true;
+                        continue;
+                    }
+                }
+                pp = &q->next;
+            }
+        }
+    }
+}
+
+/* Next transaction for the wire, requests queued past the delay bound are chained on *expired instead */
+static mb_bus_txn_t *_bus_next(mb_bus_t *b, mb_bus_txn_t **expired)
+{
+    mb_bus_txn_t *t = NULL;
+    uint32_t now = xTaskGetTickCount();
+
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+
+    for(int i=0; i<MB_BUS_CLASS_MAX && t == NULL; i++) {
+        while(b->queue[i]) {
+            t = b->queue[i];
+            b->queue[i] = t->next;
+            b->vtime = t->tag;
+            b->stats.queued[i]--;
+            if(_is_expired(t, now)) {
+                _busy(b, t, true);
+                t->next = *expired;
+                *expired = t;
+                t = NULL;
+                continue;
+            }
+            t->next = NULL;
+            _bus_coalesce(b, t);
+            b->inflight = t;
+            break;
+        }
+    }
+
+    xSemaphoreGive(b->mutex);
+
+    return t;
+}
+
+static uint32_t _unit_timeout_ms(const mb_bus_unit_t *u)
+{
+    if(u->state != MB_UNIT_ONLINE || u->samples < UNIT_MIN_SAMPLES)
+        return UNIT_TIMEOUT_MAX_MS;
+
+    uint32_t ms = (u->srtt_us + 4 * u->rttvar_us + 999) / 1000;
+    if(ms < CONFIG_MB_GATEWAY_TIMEOUT_MIN_MS)
+        ms = CONFIG_MB_GATEWAY_TIMEOUT_MIN_MS;
+    if(ms > UNIT_TIMEOUT_MAX_MS)
+        ms = UNIT_TIMEOUT_MAX_MS;
+    /* Back off after a miss, the unit may just be slow. The count keeps growing without a breaker */
+    ms <<= (u->timeouts < UNIT_BACKOFF_SHIFT_MAX) ? u->timeouts : UNIT_BACKOFF_SHIFT_MAX;
+
+    return ms < UNIT_TIMEOUT_MAX_MS ? ms : UNIT_TIMEOUT_MAX_MS;
+}
+
+/* Called with the queue locked, after each request to the unit */
+static void _unit_update(mb_bus_t *b, uint8_t addr, esp_err_t err, uint32_t turnaround_us)
+{
+    mb_bus_unit_t *u = &b->units[addr];
+
+    if(err == ESP_ERR_TIMEOUT) {
+        u->total_timeouts++;
+        if(u->timeouts < 0xff)
+            u->timeouts++;
+        if(u->state == MB_UNIT_PROBING) {
+            u->backoff_ms = (u->backoff_ms * 2 < UNIT_BACKOFF_MAX_MS) ? u->backoff_ms * 2 : UNIT_BACKOFF_MAX_MS;
+            u->state = MB_UNIT_OFFLINE;
+        } else if(CONFIG_MB_GATEWAY_BREAKER_FAILURES > 0 && u->timeouts >= CONFIG_MB_GATEWAY_BREAKER_FAILURES) {
+            u->backoff_ms = CONFIG_MB_GATEWAY_BREAKER_BACKOFF_MS;
+            u->state = MB_UNIT_OFFLINE;
+            ESP_LOGW(TAG, "UART%d unit %d offline after %d timeouts", b->port, addr, u->timeouts);
+        }
+        if(u->state == MB_UNIT_OFFLINE)
+            u->retry_tick = xTaskGetTickCount() + pdMS_TO_TICKS(u->backoff_ms);
+    } else if(err == ESP_OK || err == ESP_ERR_INVALID_CRC || err == ESP_ERR_INVALID_RESPONSE) {
+        /* Something answered, the turnaround is valid even if the frame was not */
+        int32_t delta = (int32_t)(turnaround_us - u->srtt_us);
+        if(u->samples == 0) {
+            u->srtt_us = turnaround_us;
+            u->rttvar_us = turnaround_us / 2;
+        } else {
+            u->srtt_us += delta / 8;
+            u->rttvar_us += ((delta < 0 ? -delta : delta) - (int32_t)u->rttvar_us) / 4;
+        }
+        if(u->samples < 0xffff)
+            u->samples++;
+        if(u->state != MB_UNIT_ONLINE)
+            ESP_LOGI(TAG, "UART%d unit %d back online", b->port, addr);
+        u->state = MB_UNIT_ONLINE;
+        u->timeouts = 0;
+    }
+
+    u->timeout_ms = _unit_timeout_ms(u);
+}
+
+/* The request PDU goes out as is and the slave's PDU replaces it, whatever the function */
+static void _bus_transact(mb_bus_t *b, mb_bus_txn_t *t)
+{
+    mb_bus_unit_t *u = &b->units[t->addr];
+    uint32_t timeout_ms = UNIT_TIMEOUT_MAX_MS;
+
+    if(t->addr != 0) { /* Nobody answers a broadcast */
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        bool offline = _unit_is_offline(u, xTaskGetTickCount());
+        if(offline)
+            _fail_fast(b, t);
+        else {
+            if(u->state == MB_UNIT_OFFLINE)
+                u->state = MB_UNIT_PROBING;
+            timeout_ms = _unit_timeout_ms(u);
+        }
+        xSemaphoreGive(b->mutex);
+
+        if(offline) /* Went offline while this one was queued */
+            return;
+    }
+
+    /* The unit's timeout bounds its first byte, a long answer still has to cross the wire after it */
+    mb_serial_line_t line;
+    mb_serial_get_line(b->port, &line);
+    if(line.baudrate > 0)
+        timeout_ms += ((uint64_t)_answer_bytes(t->pdu, t->pdu_len) * 11000 + line.baudrate - 1) / line.baudrate;
+
+    uint32_t turnaround_us = 0;
+    xSemaphoreTake(b->wire, portMAX_DELAY);
+    esp_err_t err = mb_serial_transact(b->port, t->addr, t->pdu, t->pdu_len, t->pdu, &t->pdu_len,
+                                       timeout_ms, &turnaround_us);
+    xSemaphoreGive(b->wire);
+
+    if(t->addr != 0) {
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        _unit_update(b, t->addr, err, turnaround_us);
+        xSemaphoreGive(b->mutex);
+    }
+
+    if(err != ESP_OK) {
+#if 0
+        ESP_LOGI(TAG, "==========  RTU -> TCP ========== ERROR %d", err);
+#endif
+        _exception(t, MB_EX_GATEWAY_TARGET_FAILED);
+    }
+}
+
+static inline uint16_t _max_regs(mb_bus_t *b, uint8_t addr)
+{
+    uint16_t max = s_max_regs[b - s_buses][addr];
+    if(max == 0 || max > MB_READ_REGS_MAX)
+        max = MB_READ_REGS_MAX;
+
+    uint8_t learned = b->units[addr].learned_regs;
+    return (learned != 0 && learned < max) ? learned : max;
+}
+
+/* Exception 03 to a read of more than one register, half of it may go through */
+static inline bool _quantity_refused(const mb_bus_txn_t *t, uint16_t count)
+{
+    return t->pdu_len == 2 && t->pdu[1] == MB_EX_ILLEGAL_DATA_VALUE && count > 1 && t->addr != 0;
+}
+
+/* Called once a read of count registers went through after larger ones were refused */
+static void _max_regs_learn(mb_bus_t *b, uint8_t addr, uint16_t count)
+{
+    mb_bus_unit_t *u = &b->units[addr];
+    if(count >= _max_regs(b, addr))
+        return;
+
+    u->learned_regs = count;
+    u->learned_hits = 0;
+    ESP_LOGW(TAG, "UART%d unit %d refused more than %d registers, reads now split by %d", b->port, addr, count, count);
+}
+
+/* A learned limit is doubled back after enough reads, a refusal learns it again */
+static void _max_regs_recover(mb_bus_t *b, uint8_t addr)
+{
+    mb_bus_unit_t *u = &b->units[addr];
+    if(u->learned_regs == 0 || ++u->learned_hits < LEARNED_REGS_RECOVER)
+        return;
+
+    u->learned_regs = (u->learned_regs * 2 >= MB_READ_REGS_MAX) ? 0 : u->learned_regs * 2;
+    u->learned_hits = 0;
+}
+
+static inline void _read_request(mb_bus_txn_t *t, uint8_t function, uint16_t start, uint16_t count)
+{
+    t->pdu[0] = function;
+    t->pdu[1] = start >> 8;
+    t->pdu[2] = start & 0xff;
+    t->pdu[3] = count >> 8;
+    t->pdu[4] = count & 0xff;
+    t->pdu_len = 5;
+}
+
+/* Reads above the unit's limit are served part by part, reassembled in t */
+static void _bus_execute(mb_bus_t *b, mb_bus_txn_t *t)
+{
+    uint8_t function = t->pdu[0];
+    uint16_t start, count;
+
+    if(_read_range(t, &start, &count) == false) {
+        _bus_transact(b, t);
+        return;
+    }
+
+    uint16_t part = _max_regs(b, t->addr);
+    bool probing = false; /* Parts smaller than refused, learned only if one goes through */
+
+    if(count <= part) {
+        _bus_transact(b, t);
+        if(_quantity_refused(t, count) == false) {
+            if(t->pdu[0] == function)
+                _max_regs_recover(b, t->addr);
+            return;
+        }
+        part = count / 2;
+        probing = true;
+    }
+
+    mb_bus_txn_t *c = &b->split_txn;
+    c->uid = t->uid;
+    c->addr = t->addr;
+
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    b->stats.split++;
+    xSemaphoreGive(b->mutex);
+
+    uint16_t done = 0;
+    while(done < count) {
+        uint16_t n = count - done;
+        if(n > part)
+            n = part;
+
+        _read_request(c, function, start + done, n);
+        _bus_transact(b, c);
+
+        if(c->pdu[0] == function && c->pdu_len == 2 + n * 2) {
+            memcpy(&t->pdu[2 + done * 2], &c->pdu[2], n * 2);
+            done += n;
+            if(probing) {
+                _max_regs_learn(b, t->addr, part);
+                probing = false;
+            } else
+                _max_regs_recover(b, t->addr);
+        } else if(_quantity_refused(c, n)) {
+            part = n / 2;
+            probing = true;
+        } else {
+            memcpy(t->pdu, c->pdu, c->pdu_len); /* The first failure answers for the whole read */
+            t->pdu_len = c->pdu_len;
+            return;
+        }
+    }
+
+    t->pdu[0] = function;
+    t->pdu[1] = count * 2;
+    t->pdu_len = 2 + count * 2;
+}
+
+static void _bus_complete(mb_bus_t *b, mb_bus_txn_t *t)
+{
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    /* Members complete in chain order, closing t to new followers */
+    if(b->inflight == t)
+        b->inflight = t->next;
+    t->next = NULL;
+    mb_bus_txn_t *f = t->followers;
+    t->followers = NULL;
+    xSemaphoreGive(b->mutex);
+
+    uint32_t wait_ms = (xTaskGetTickCount() - t->queued_tick) * portTICK_PERIOD_MS;
+    if(wait_ms > b->stats.max_wait_ms[t->cls])
+        b->stats.max_wait_ms[t->cls] = wait_ms;
+    b->stats.served[t->cls]++;
+
+    if(_is_write(t->req[0])) {
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        s_write_gen[t->bus][t->addr]++;
+        xSemaphoreGive(b->mutex);
+        _invalidate_routed(t->bus, t->addr, t->req, t->req_len);
+    } else {
+        /* Checked and stored under the queue lock, a write bumps the generation before it invalidates */
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        if(t->gen == _gen(t->uid, t->bus, t->addr))
+            mb_cache_store(t->uid, t->req, t->req_len, t->pdu, t->pdu_len);
+        xSemaphoreGive(b->mutex);
+    }
+
+    while(f) {
+        mb_bus_txn_t *next = f->next;
+        f->next = NULL;
+        memcpy(f->pdu, t->pdu, t->pdu_len);
+        f->pdu_len = t->pdu_len;
+        f->done(f);
+        f = next;
+    }
+
+    t->done(t);
+}
+
+static void _bus_execute_single(mb_bus_t *b, mb_bus_txn_t *t)
+{
+    _bus_execute(b, t);
+    _bus_complete(b, t);
+}
+
+/* One read covering every request chained on head, each gets its own slice back */
+static void _bus_execute_group(mb_bus_t *b, mb_bus_txn_t *head)
+{
+    mb_bus_txn_t *g = &b->group_txn;
+    uint8_t function = head->pdu[0];
+    uint16_t s, n;
+    uint32_t lo = 0xffff, hi = 0;
+
+    for(mb_bus_txn_t *m = head; m; m = m->next) {
+        _read_range(m, &s, &n);
+        if(s < lo)
+            lo = s;
+        if(s + n > hi)
+            hi = s + n;
+    }
+
+    g->uid = head->uid;
+    g->addr = head->addr;
+    g->pdu[0] = function;
+    g->pdu[1] = lo >> 8;
+    g->pdu[2] = lo & 0xff;
+    g->pdu[3] = (hi - lo) >> 8;
+    g->pdu[4] = (hi - lo) & 0xff;
+    g->pdu_len = 5;
+
+    _bus_execute(b, g);
+
+    bool ok = (g->pdu[0] == function && g->pdu_len == 2 + (hi - lo) * 2);
+    bool retry = (g->pdu[0] == (function | 0x80) && g->pdu[1] == MB_EX_ILLEGAL_DATA_ADDRESS);
+
+    mb_bus_txn_t *m = head;
+    while(m) {
+        mb_bus_txn_t *next = m->next; /* m->next is cleared once m completes */
+
+        if(retry) {
+            /* A bridged gap is not mapped on the slave, ask for each range alone */
+            _bus_execute_single(b, m);
+        } else {
+            _read_range(m, &s, &n);
+            if(ok) {
+                m->pdu[1] = n * 2;
+                memcpy(&m->pdu[2], &g->pdu[2 + (s - lo) * 2], n * 2);
+                m->pdu_len = 2 + n * 2;
+            } else {
+                memcpy(m->pdu, g->pdu, g->pdu_len);
+                m->pdu_len = g->pdu_len;
+            }
+            _bus_complete(b, m);
+        }
+
+        m = next;
+    }
+}
+
+static void _bus_task(void *pvParameters)
+{
+    mb_bus_t *b = (mb_bus_t *)pvParameters;
+
+    while(1) {
+        if(xSemaphoreTake(b->count, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        mb_bus_txn_t *expired = NULL;
+        mb_bus_txn_t *t = _bus_next(b, &expired);
+
+        while(expired) { /* Their clients gave up, do not spend the bus on them */
+            mb_bus_txn_t *next = expired->next;
+            _bus_complete(b, expired);
+            expired = next;
+        }
+
+        if(t == NULL) /* Already served as part of a merged read */
+            continue;
+
+        int64_t t0 = esp_timer_get_time();
+
+        if(t->next)
+            _bus_execute_group(b, t);
+        else
+            _bus_execute_single(b, t);
+
+        int32_t service_us = esp_timer_get_time() - t0;
+        b->service_us += (service_us - (int32_t)b->service_us) / 8;
+    }
+
+    vTaskDelete(NULL);
+}
+
+static void _bus_reset_units(mb_bus_t *b)
+{
+    for(int i=0; i<256; i++) {
+        memset(&b->units[i], 0, sizeof(mb_bus_unit_t));
+        b->units[i].timeout_ms = UNIT_TIMEOUT_MAX_MS;
+    }
+}
+
+void initialize_modbus_bus()
+{
+    mb_bus_init();
+
+    mb_serial_config_t config = {
+#if CONFIG_MB_COMM_MODE_ASCII
+        .mode = MB_SERIAL_MODE_ASCII,
+#else
+        .mode = MB_SERIAL_MODE_RTU,
+#endif
+        .line = { MB_DEV_SPEED, UART_PARITY_EVEN, UART_STOP_BITS_1 },
+        .txd = CONFIG_MB_UART_TXD,
+        .rxd = CONFIG_MB_UART_RXD,
+        .rts = CONFIG_MB_UART_RTS
+    };
+    mb_bus_start(0, MB_PORT_NUM, &config);
+#if CONFIG_MB_GATEWAY_BUS1
+    config.line.baudrate = CONFIG_MB_GATEWAY_BUS1_BAUD_RATE;
+    config.txd = CONFIG_MB_GATEWAY_BUS1_UART_TXD;
+    config.rxd = CONFIG_MB_GATEWAY_BUS1_UART_RXD;
+    config.rts = CONFIG_MB_GATEWAY_BUS1_UART_RTS;
+    mb_bus_start(1, CONFIG_MB_GATEWAY_BUS1_UART_PORT_NUM, &config);
+#endif
+#if CONFIG_MB_GATEWAY_BUS2
+    config.line.baudrate = CONFIG_MB_GATEWAY_BUS2_BAUD_RATE;
+    config.txd = CONFIG_MB_GATEWAY_BUS2_UART_TXD;
+    config.rxd = CONFIG_MB_GATEWAY_BUS2_UART_RXD;
+    config.rts = CONFIG_MB_GATEWAY_BUS2_UART_RTS;
+    mb_bus_start(2, CONFIG_MB_GATEWAY_BUS2_UART_PORT_NUM, &config);
+#endif
+}
+
+esp_err_t mb_bus_init()
+{
+    for(int i=0; i<256; i++) { /* Every unit on the first bus, same address */
+        s_routes[i].bus = 0;
+        s_routes[i].addr = i;
+    }
+
+    mb_bus_load_config();
+
+    mb_vmap_init();
+
+    return mb_cache_init();
+}
+
+esp_err_t mb_bus_start(uint8_t bus, uart_port_t port, const mb_serial_config_t *config)
+{
+    if(bus >= MB_BUS_MAX || s_buses[bus].started)
+        return ESP_ERR_INVALID_ARG;
+
+    mb_bus_t *b = &s_buses[bus];
+    memset(b->queue, 0, sizeof(b->queue));
+    memset(&b->stats, 0, sizeof(b->stats));
+    b->inflight = NULL;
+    b->vtime = 0;
+    b->service_us = 0;
+    b->port = port;
+    b->mutex = xSemaphoreCreateMutex();
+    b->count = xSemaphoreCreateCounting(0xffff, 0);
+    b->wire = xSemaphoreCreateMutex();
+    _bus_reset_units(b);
+
+    mb_serial_config_t c = *config;
+    if(s_lines[bus].baudrate != 0)
+        c.line = s_lines[bus];
+
+    esp_err_t err = mb_serial_init(port, &c);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Bus %d on UART%d not started", bus, port);
+        return err;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "_bus_task%d", bus);
+    xTaskCreatePinnedToCore(&_bus_task, name, 4096, b, 4, NULL, 0);
+
+    b->started = true;
+
+    return ESP_OK;
+}
+
+bool mb_bus_is_started(uint8_t bus)
+{
+    return bus < MB_BUS_MAX && s_buses[bus].started;
+}
+
+uint32_t mb_bus_cost_us(uint8_t uid, const uint8_t *pdu, uint16_t pdu_len)
+{
+    const mb_bus_route_t *r = &s_routes[uid];
+    if(mb_bus_is_started(r->bus) == false)
+        return 0;
+
+    mb_bus_t *b = &s_buses[r->bus];
+    mb_serial_line_t line;
+    mb_serial_get_line(b->port, &line);
+    if(line.baudrate <= 0)
+        return 0;
+
+    /* 11 bits a character, plus what the unit usually takes to answer */
+    return (uint64_t)_pdu_cost(pdu, pdu_len) * 11000000 / line.baudrate + b->units[r->addr].srtt_us;
+}
+
+esp_err_t mb_bus_set_route(uint8_t uid, uint8_t bus, uint8_t addr)
+{
+    if(bus >= MB_BUS_MAX)
+        return ESP_ERR_INVALID_ARG;
+
+    mb_bus_route_t old = s_routes[uid];
+    if(old.bus == bus && old.addr == addr)
+        return ESP_OK;
+
+    /* Answers of the old slave still on their way must not be stored under uid */
+    mb_bus_t *b = (old.bus < MB_BUS_MAX && s_buses[old.bus].started) ? &s_buses[old.bus] : NULL;
+    if(b)
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+    s_routes[uid].bus = bus;
+    s_routes[uid].addr = addr;
+    s_route_gen[uid]++;
+    if(b)
+        xSemaphoreGive(b->mutex);
+
+    /* Nor served from what is kept of them */
+    mb_cache_invalidate_unit(uid);
+    mb_scan_invalidate_unit(uid);
+
+    return ESP_OK;
+}
+
+void mb_bus_get_route(uint8_t uid, mb_bus_route_t *route)
+{
+    *route = s_routes[uid];
+}
+
+esp_err_t mb_bus_set_line(uint8_t bus, const mb_serial_line_t *line)
+{
+    if(mb_bus_is_started(bus) == false)
+        return ESP_ERR_INVALID_STATE;
+
+    mb_bus_t *b = &s_buses[bus];
+
+    xSemaphoreTake(b->wire, portMAX_DELAY);
+    esp_err_t err = mb_serial_set_line(b->port, line);
+    xSemaphoreGive(b->wire);
+
+    if(err == ESP_OK) {
+        s_lines[bus] = *line;
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        _bus_reset_units(b); /* Turnaround history is for the old speed */
+        xSemaphoreGive(b->mutex);
+    }
+
+    return err;
+}
+
+esp_err_t mb_bus_get_line(uint8_t bus, mb_serial_line_t *line)
+{
+    if(mb_bus_is_started(bus) == false)
+        return ESP_ERR_INVALID_STATE;
+
+    mb_serial_get_line(s_buses[bus].port, line);
+
+    return ESP_OK;
+}
+
+/* Any well formed answer, exceptions included, means the line settings are right */
+static bool _autobaud_probe(mb_bus_t *b, uint8_t addr)
+{
+    uint8_t pdu[MB_PDU_SIZE_MAX] = { MB_FUNC_READ_HOLDING_REGISTERS, 0, 0, 0, 1 };
+    uint16_t len = 5;
+
+    return mb_serial_transact(b->port, addr, pdu, len, pdu, &len, AUTOBAUD_PROBE_TIMEOUT_MS, NULL) == ESP_OK;
+}
+
+esp_err_t mb_bus_autobaud(uint8_t bus, uint8_t addr, mb_serial_line_t *found)
+{
+    if(mb_bus_is_started(bus) == false)
+        return ESP_ERR_INVALID_STATE;
+    if(addr == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    mb_bus_t *b = &s_buses[bus];
+    mb_serial_line_t old, line;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    xSemaphoreTake(b->wire, portMAX_DELAY); /* The bus is ours until detection ends */
+
+    mb_serial_get_line(b->port, &old);
+
+    for(int i=0; i<sizeof(s_autobaud_rates) / sizeof(s_autobaud_rates[0]) && err != ESP_OK; i++) {
+        for(int j=0; j<sizeof(s_autobaud_framings) / sizeof(s_autobaud_framings[0]); j++) {
+            line.baudrate = s_autobaud_rates[i];
+            line.parity = s_autobaud_framings[j].parity;
+            line.stop_bits = s_autobaud_framings[j].stop_bits;
+            if(mb_serial_set_line(b->port, &line) != ESP_OK)
+                continue;
+            if(_autobaud_probe(b, addr) && _autobaud_probe(b, addr)) {
+                err = ESP_OK;
+                break;
+            }
+        }
+    }
+
+    if(err != ESP_OK)
+        mb_serial_set_line(b->port, &old);
+
+    xSemaphoreGive(b->wire);
+
+    if(err == ESP_OK) {
+        ESP_LOGI(TAG, "Bus %d unit %d answers at %d bps", bus, addr, line.baudrate);
+        s_lines[bus] = line;
+        *found = line;
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        _bus_reset_units(b);
+        xSemaphoreGive(b->mutex);
+    } else
+        ESP_LOGW(TAG, "Bus %d unit %d not detected", bus, addr);
+
+    return err;
+}
+
+void mb_bus_set_unit_priority(uint8_t uid, bool enable)
+{
+    if(enable)
+        s_unit_prio[uid >> 3] |= (1 << (uid & 7));
+    else
+        s_unit_prio[uid >> 3] &= ~(1 << (uid & 7));
+}
+
+bool mb_bus_get_unit_priority(uint8_t uid)
+{
+    return (s_unit_prio[uid >> 3] & (1 << (uid & 7))) != 0;
+}
+
+void mb_bus_set_coalesce_gap(int16_t gap)
+{
+    s_coalesce_gap = gap < 0 ? -1 : (gap > MB_READ_REGS_MAX ? MB_READ_REGS_MAX : gap);
+}
+
+int16_t mb_bus_get_coalesce_gap()
+{
+    return s_coalesce_gap;
+}
+
+void mb_bus_set_queue_delay(uint16_t ms)
+{
+    s_queue_delay_ms = ms;
+}
+
+uint16_t mb_bus_get_queue_delay()
+{
+    return s_queue_delay_ms;
+}
+
+esp_err_t mb_bus_get_stats(uint8_t bus, mb_bus_stats_t *stats)
+{
+    if(mb_bus_is_started(bus) == false)
+        return ESP_ERR_INVALID_STATE;
+
+    mb_bus_t *b = &s_buses[bus];
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    memcpy(stats, &b->stats, sizeof(mb_bus_stats_t));
+    xSemaphoreGive(b->mutex);
+    stats->port = b->port;
+    stats->service_us = b->service_us;
+
+    return ESP_OK;
+}
+
+bool mb_bus_get_unit(uint8_t bus, uint8_t addr, mb_bus_unit_t *unit)
+{
+    if(mb_bus_is_started(bus) == false)
+        return false;
+
+    mb_bus_t *b = &s_buses[bus];
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    memcpy(unit, &b->units[addr], sizeof(mb_bus_unit_t));
+    xSemaphoreGive(b->mutex);
+
+    return unit->samples > 0 || unit->total_timeouts > 0;
+}
+
+void mb_bus_set_max_regs(uint8_t bus, uint8_t addr, uint8_t max)
+{
+    if(bus < MB_BUS_MAX)
+        s_max_regs[bus][addr] = max > MB_READ_REGS_MAX ? 0 : max;
+}
+
+uint8_t mb_bus_get_max_regs(uint8_t bus, uint8_t addr)
+{
+    return bus < MB_BUS_MAX ? s_max_regs[bus][addr] : 0;
+}
+
+void mb_bus_reset_unit(uint8_t bus, uint8_t addr)
+{
+    if(mb_bus_is_started(bus) == false)
+        return;
+
+    mb_bus_t *b = &s_buses[bus];
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    memset(&b->units[addr], 0, sizeof(mb_bus_unit_t));
+    b->units[addr].timeout_ms = UNIT_TIMEOUT_MAX_MS;
+    xSemaphoreGive(b->mutex);
+}
+
+static nvs_handle my_nvs_handle;
+
+#define CMD_MB_UNIT_PRIO "mb_unit_prio"
+#define CMD_MB_COALESCE_GAP "mb_coalesce"
+#define CMD_MB_ROUTE "mb_route"
+#define CMD_MB_LINE "mb_line"
+#define CMD_MB_MAX_REGS "mb_max_regs"
+#define CMD_MB_QUEUE_DELAY "mb_queue_delay"
+
+void mb_bus_load_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    size_t l = sizeof(s_unit_prio);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_UNIT_PRIO, s_unit_prio, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No unit priority cached ...");
+    }
+
+    l = sizeof(s_coalesce_gap);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_COALESCE_GAP, &s_coalesce_gap, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No coalesce gap cached ...");
+    }
+
+    l = sizeof(s_routes);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_ROUTE, s_routes, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No unit route cached ...");
+    }
+
+    l = sizeof(s_lines);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_LINE, s_lines, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No line setting cached ...");
+    }
+
+    l = sizeof(s_max_regs);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_MAX_REGS, s_max_regs, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No read limit cached ...");
+    }
+
+    l = sizeof(s_queue_delay_ms);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_QUEUE_DELAY, &s_queue_delay_ms, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No queue delay cached ...");
+    }
+
+    nvs_close(my_nvs_handle);
+}
+
+void mb_bus_save_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_UNIT_PRIO, s_unit_prio, sizeof(s_unit_prio));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save unit priority !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_COALESCE_GAP, &s_coalesce_gap, sizeof(s_coalesce_gap));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save coalesce gap !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_ROUTE, s_routes, sizeof(s_routes));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save unit route !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_LINE, s_lines, sizeof(s_lines));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save line setting !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_MAX_REGS, s_max_regs, sizeof(s_max_regs));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save read limit !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_QUEUE_DELAY, &s_queue_delay_ms, sizeof(s_queue_delay_ms));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save queue delay !!!");
+
+    nvs_commit(my_nvs_handle);
+    nvs_close(my_nvs_handle);
+}
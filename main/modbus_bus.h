@@ -0,0 +1,147 @@
+#ifndef _MODBUS_BUS_H
+#define _MODBUS_BUS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "driver/uart.h"
+
+#include "modbus_serial.h"
+
+#define MB_PDU_SIZE_MAX 253
+
+#define MB_BUS_MAX 3 /* One per UART, UART0 is the console */
+
+//
+// Scheduling classes, a lower class is always served first.
+// Within a class clients share the bus by weighted fair queuing.
+//
+typedef enum {
+    MB_BUS_CLASS_WRITE = 0, /* Any write, jumps ahead of reads */
+    MB_BUS_CLASS_PRIORITY,  /* Reads to priority unit IDs */
+    MB_BUS_CLASS_READ,      /* Everything else */
+    MB_BUS_CLASS_BACKGROUND, /* Background polling, takes the bus when nobody else does */
+    MB_BUS_CLASS_MAX
+} mb_bus_class_t;
+
+typedef struct {
+    uint16_t weight; /* Share of the bus relative to other clients */
+    uint32_t finish[MB_BUS_MAX]; /* Virtual finish time of the last queued transaction, per bus */
+} mb_bus_client_t;
+
+typedef struct mb_bus_txn mb_bus_txn_t;
+
+#define MB_BUS_TXN_FRESH (1 << 0) /* Always read from the slave, bypass the shadow map and the cache */
+#define MB_BUS_TXN_BACKGROUND (1 << 1) /* Read scheduled in MB_BUS_CLASS_BACKGROUND */
+
+struct mb_bus_txn {
+    mb_bus_txn_t *next;
+    mb_bus_txn_t *followers; /* Identical reads answered with this one's response */
+    mb_bus_client_t *client;
+    void (*done)(mb_bus_txn_t *t); /* Called once pdu holds the response, from the bus task or from mb_bus_submit() on a cache hit */
+    uint32_t tag; /* Virtual start time, order within the class */
+    uint32_t queued_tick;
+    uint32_t gen; /* Write generation of uid and its route when submitted */
+    uint8_t cls;
+    uint8_t flags;
+    uint8_t uid; /* As addressed by the client */
+    uint8_t bus; /* Route of uid, resolved by mb_bus_submit() */
+    uint8_t addr;
+    uint16_t pdu_len;
+    uint8_t pdu[MB_PDU_SIZE_MAX]; /* Request PDU, overwritten by the response PDU */
+    uint16_t req_len;
+    uint8_t req[9]; /* Request header, kept once pdu holds the response */
+};
+
+typedef struct {
+    uart_port_t port;
+    uint32_t queued[MB_BUS_CLASS_MAX];
+    uint32_t served[MB_BUS_CLASS_MAX];
+    uint32_t max_wait_ms[MB_BUS_CLASS_MAX];
+    uint32_t coalesced; /* Reads served by another request's bus transaction */
+    uint32_t deduplicated; /* Reads attached to an identical queued or in flight read */
+    uint32_t fast_failed; /* Answered 0x0B at once, the unit was offline */
+    uint32_t split; /* Reads above the unit's limit, served by several bus transactions */
+    uint32_t rejected; /* Answered 0x06 at once, the queue was too long */
+    uint32_t expired; /* Answered 0x06 without the wire, queued past the delay bound */
+    uint32_t service_us; /* Average bus time per transaction */
+} mb_bus_stats_t;
+
+typedef enum {
+    MB_UNIT_ONLINE = 0,
+    MB_UNIT_OFFLINE, /* Circuit open, requests fail fast until retry_tick */
+    MB_UNIT_PROBING, /* One request on the wire decides online or offline */
+} mb_bus_unit_state_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t timeouts; /* Consecutive */
+    uint16_t samples;
+    uint32_t srtt_us; /* Smoothed turnaround time */
+    uint32_t rttvar_us;
+    uint32_t timeout_ms; /* Current response timeout */
+    uint32_t backoff_ms;
+    uint32_t retry_tick;
+    uint32_t total_timeouts;
+    uint8_t learned_regs; /* Registers per read learned from refusals, 0 if none, not saved */
+    uint8_t learned_hits; /* Reads served under learned_regs since it was last changed */
+} mb_bus_unit_t;
+
+typedef struct {
+    uint8_t bus;
+    uint8_t addr; /* Slave address on that bus */
+} mb_bus_route_t;
+
+/* Starts the buses enabled in Kconfig, every RS485 master (gateway, poller) submits to them */
+void initialize_modbus_bus();
+
+esp_err_t mb_bus_init();
+esp_err_t mb_bus_start(uint8_t bus, uart_port_t port, const mb_serial_config_t *config);
+bool mb_bus_is_started(uint8_t bus);
+
+/* Applied between two transactions, saved with mb_bus_save_config() */
+esp_err_t mb_bus_set_line(uint8_t bus, const mb_serial_line_t *line);
+esp_err_t mb_bus_get_line(uint8_t bus, mb_serial_line_t *line);
+/* Finds the fastest line settings unit addr answers to and keeps them, blocks the bus meanwhile */
+esp_err_t mb_bus_autobaud(uint8_t bus, uint8_t addr, mb_serial_line_t *found);
+
+esp_err_t mb_bus_set_route(uint8_t uid, uint8_t bus, uint8_t addr);
+void mb_bus_get_route(uint8_t uid, mb_bus_route_t *route);
+
+void mb_bus_client_init(mb_bus_client_t *c, uint16_t weight);
+void mb_bus_submit(mb_bus_txn_t *t);
+/* Moves on every write to the slave uid leads to, and when its route changes, a read answered under an older one may be stale */
+uint32_t mb_bus_write_gen(uint8_t uid);
+/* Estimated bus time of a request to uid, answer included */
+uint32_t mb_bus_cost_us(uint8_t uid, const uint8_t *pdu, uint16_t pdu_len);
+
+void mb_bus_set_unit_priority(uint8_t uid, bool enable);
+bool mb_bus_get_unit_priority(uint8_t uid);
+
+void mb_bus_set_coalesce_gap(int16_t gap); /* Registers bridged between merged reads, -1 disables */
+int16_t mb_bus_get_coalesce_gap();
+
+void mb_bus_set_queue_delay(uint16_t ms); /* Longest a client request may wait for the bus, 0 disables */
+uint16_t mb_bus_get_queue_delay();
+
+esp_err_t mb_bus_get_stats(uint8_t bus, mb_bus_stats_t *stats);
+bool mb_bus_get_unit(uint8_t bus, uint8_t addr, mb_bus_unit_t *unit); /* False if the unit was never addressed */
+void mb_bus_reset_unit(uint8_t bus, uint8_t addr);
+
+/* Registers the unit takes per read, 0 for the full 125. A lower limit is learned on its own, see mb_bus_unit_t */
+void mb_bus_set_max_regs(uint8_t bus, uint8_t addr, uint8_t max);
+uint8_t mb_bus_get_max_regs(uint8_t bus, uint8_t addr);
+
+void mb_bus_load_config();
+void mb_bus_save_config();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
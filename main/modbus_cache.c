@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "nvs_flash.h"
+
+#include "sdkconfig.h"
+
+#include "esp32_malloc.h"
+#include "modbus_cache.h"
+
+static const char *TAG = "mb_cache";
+
+//
+// FC3 / FC4 response cache : set associative, 4 ways per set, kept in PSRAM.
+// An entry is keyed by (unit ID, function, start, count) and stays valid for
+// the TTL of the matching range rule, or of the unit when no rule matches.
+//
+#define CACHE_WAYS 4
+#define CACHE_SETS (CONFIG_MB_GATEWAY_CACHE_ENTRIES / CACHE_WAYS)
+
+#define CACHE_PDU_SIZE (2 + 125 * 2) // Function, byte count, 125 registers
+
+typedef struct {
+    uint8_t uid;
+    uint8_t function;
+    uint16_t start;
+    uint16_t count;
+    uint16_t len; // Response PDU length, 0 when empty
+    uint32_t stamp; // Tick of acquisition
+    uint8_t pdu[CACHE_PDU_SIZE];
+} cache_entry_t;
+
+static cache_entry_t *s_entries = NULL;
+static xSemaphoreHandle s_cache_mutex;
+
+static uint16_t s_unit_ttl[256];
+static mb_cache_rule_t s_rules[MB_CACHE_MAX_RULES];
+
+static mb_cache_stats_t s_stats = { 0 };
+
+static bool _parse_read(const uint8_t *req, uint16_t req_len, uint16_t *start, uint16_t *count)
+{
+    if(req_len != 5 || (req[0] != 3 && req[0] != 4))
+        return false;
+
+    *start = (req[1] << 8) + req[2];
+    *count = (req[3] << 8) + req[4];
+
+    return *count >= 1 && *count <= 125;
+}
+
+static uint16_t _ttl(uint8_t uid, uint8_t function, uint16_t start, uint16_t count)
+{
+    for(int i=0; i<MB_CACHE_MAX_RULES; i++) {
+        mb_cache_rule_t *r = &s_rules[i];
+        if(r->ttl_ms == 0 || r->uid != uid || r->function != function)
+            continue;
+        if(start >= r->start && (uint32_t)start + count <= (uint32_t)r->start + r->count)
+            return r->ttl_ms;
+    }
+
+    return s_unit_ttl[uid];
+}
+
+static inline cache_entry_t *_set(uint8_t uid, uint8_t function, uint16_t start, uint16_t count)
+{
+    uint32_t h = ((uid * 31 + function) * 31 + start) * 31 + count;
+    return &s_entries[(h % CACHE_SETS) * CACHE_WAYS];
+}
+
+esp_err_t mb_cache_init()
+{
+    s_cache_mutex = xSemaphoreCreateMutex();
+
+    for(int i=0; i<256; i++)
+        s_unit_ttl[i] = CONFIG_MB_GATEWAY_CACHE_TTL_MS;
+
+    mb_cache_load_config();
+
+    if(CACHE_SETS == 0)
+        return ESP_OK; /* Cache disabled */
+
+    s_entries = (cache_entry_t *)esp32_malloc(CACHE_SETS * CACHE_WAYS * sizeof(cache_entry_t));
+    if(s_entries == NULL) {
+        ESP_LOGE(TAG, "No memory for %d cache entries", CACHE_SETS * CACHE_WAYS);
+        return ESP_ERR_NO_MEM;
+    }
+    memset(s_entries, 0, CACHE_SETS * CACHE_WAYS * sizeof(cache_entry_t));
+
+    return ESP_OK;
+}
+
+bool mb_cache_lookup(uint8_t uid, const uint8_t *req, uint16_t req_len, uint8_t *rsp, uint16_t *rsp_len)
+{
+    uint16_t start, count;
+
+    if(s_entries == NULL || _parse_read(req, req_len, &start, &count) == false)
+        return false;
+
+    uint16_t ttl = _ttl(uid, req[0], start, count);
+    if(ttl == 0)
+        return false;
+
+    bool hit = false;
+
+    xSemaphoreTake(s_cache_mutex, portMAX_DELAY);
+
+    cache_entry_t *e = _set(uid, req[0], start, count);
+    for(int i=0; i<CACHE_WAYS; i++, e++) {
+        if(e->len == 0 || e->uid != uid || e->function != req[0] || e->start != start || e->count != count)
+            continue;
+        if((xTaskGetTickCount() - e->stamp) * portTICK_PERIOD_MS < ttl) {
+            memcpy(rsp, e->pdu, e->len);
+            *rsp_len = e->len;
+            hit = true;
+        }
+        break;
+    }
+
+    if(hit)
+        s_stats.hits++;
+    else
+        s_stats.misses++;
+
+    xSemaphoreGive(s_cache_mutex);
+
+    return hit;
+}
+
+void mb_cache_store(uint8_t uid, const uint8_t *req, uint16_t req_len, const uint8_t *rsp, uint16_t rsp_len)
+{
+    uint16_t start, count;
+
+    if(s_entries == NULL || _parse_read(req, req_len, &start, &count) == false)
+        return;
+
+    /* Exceptions and short answers are never cached */
+    if(rsp[0] != req[0] || rsp_len != 2 + count * 2)
+        return;
+
+    if(_ttl(uid, req[0], start, count) == 0)
+        return;
+
+    xSemaphoreTake(s_cache_mutex, portMAX_DELAY);
+
+    /* Same key, else an empty way, else the oldest one */
+    cache_entry_t *e = _set(uid, req[0], start, count);
+    cache_entry_t *victim = e;
+    for(int i=0; i<CACHE_WAYS; i++, e++) {
+        if(e->len != 0 && e->uid == uid && e->function == req[0] && e->start == start && e->count == count) {
+            victim = e;
+            break;
+        }
+        if(victim->len != 0 && (e->len == 0 || (int32_t)(e->stamp - victim->stamp) < 0))
+            victim = e;
+    }
+
+    victim->uid = uid;
+    victim->function = req[0];
+    victim->start = start;
+    victim->count = count;
+    victim->stamp = xTaskGetTickCount();
+    memcpy(victim->pdu, rsp, rsp_len);
+    victim->len = rsp_len;
+
+    s_stats.stores++;
+
+    xSemaphoreGive(s_cache_mutex);
+}
+
+/* Drops every cached register block overlapping the range written by req */
+void mb_cache_invalidate(uint8_t uid, const uint8_t *req, uint16_t req_len)
+{
+    uint16_t start, count;
+
+    if(s_entries == NULL)
+        return;
+
+    switch(req[0]) {
+        case 6: /* Write single register */
+        case 22: /* Mask write register */
+            if(req_len < 3)
+                return;
+            start = (req[1] << 8) + req[2];
+            count = 1;
+            break;
+        case 16: /* Write multiple registers */
+            if(req_len < 5)
+                return;
+            start = (req[1] << 8) + req[2];
+            count = (req[3] << 8) + req[4];
+            break;
+        case 23: /* Read / write multiple registers */
+            if(req_len < 9)
+                return;
+            start = (req[5] << 8) + req[6];
+            count = (req[7] << 8) + req[8];
+            break;
+        default: /* Coils are not cached */
+            return;
+    }
+
+    xSemaphoreTake(s_cache_mutex, portMAX_DELAY);
+
+    for(int i=0; i<CACHE_SETS * CACHE_WAYS; i++) {
+        cache_entry_t *e = &s_entries[i];
+        if(e->len == 0 || (uid != 0 && e->uid != uid)) /* Unit 0 is broadcast */
+            continue;
+        if((uint32_t)e->start + e->count <= start || (uint32_t)start + count <= e->start)
+            continue;
+        e->len = 0;
+        s_stats.invalidations++;
+    }
+
+    xSemaphoreGive(s_cache_mutex);
+}
+
+void mb_cache_invalidate_unit(uint8_t uid)
+{
+    if(s_entries == NULL)
+        return;
+
+    xSemaphoreTake(s_cache_mutex, portMAX_DELAY);
+    for(int i=0; i<CACHE_SETS * CACHE_WAYS; i++) {
+        cache_entry_t *e = &s_entries[i];
+        if(e->len == 0 || e->uid != uid)
+            continue;
+        e->len = 0;
+        s_stats.invalidations++;
+    }
+    xSemaphoreGive(s_cache_mutex);
+}
+
+void mb_cache_clear()
+{
+    if(s_entries == NULL)
+        return;
+
+    xSemaphoreTake(s_cache_mutex, portMAX_DELAY);
+    for(int i=0; i<CACHE_SETS * CACHE_WAYS; i++)
+        s_entries[i].len = 0;
+    xSemaphoreGive(s_cache_mutex);
+}
+
+void mb_cache_set_unit_ttl(uint8_t uid, uint16_t ttl_ms)
+{
+    s_unit_ttl[uid] = ttl_ms;
+}
+
+uint16_t mb_cache_get_unit_ttl(uint8_t uid)
+{
+    return s_unit_ttl[uid];
+}
+
+esp_err_t mb_cache_set_rule(const mb_cache_rule_t *rule)
+{
+    if(rule->function != 3 && rule->function != 4)
+        return ESP_ERR_INVALID_ARG;
+
+    mb_cache_rule_t *slot = NULL;
+    for(int i=0; i<MB_CACHE_MAX_RULES; i++) {
+        mb_cache_rule_t *r = &s_rules[i];
+        if(r->ttl_ms != 0 && r->uid == rule->uid && r->function == rule->function &&
+            r->start == rule->start && r->count == rule->count) {
+            slot = r; /* Replace existing rule */
+            break;
+        }
+        if(slot == NULL && r->ttl_ms == 0)
+            slot = r;
+    }
+
+    if(slot == NULL)
+        return ESP_ERR_NO_MEM;
+
+    memcpy(slot, rule, sizeof(mb_cache_rule_t));
+    return ESP_OK;
+}
+
+const mb_cache_rule_t *mb_cache_get_rule(int index)
+{
+    if(index < 0 || index >= MB_CACHE_MAX_RULES || s_rules[index].ttl_ms == 0)
+        return NULL;
+    return &s_rules[index];
+}
+
+void mb_cache_get_stats(mb_cache_stats_t *stats)
+{
+    xSemaphoreTake(s_cache_mutex, portMAX_DELAY);
+    memcpy(stats, &s_stats, sizeof(mb_cache_stats_t));
+    xSemaphoreGive(s_cache_mutex);
+}
+
+static nvs_handle my_nvs_handle;
+
+#define CMD_MB_CACHE_TTL "mb_cache_ttl"
+#define CMD_MB_CACHE_RULE "mb_cache_rule"
+
+void mb_cache_load_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    size_t l = sizeof(s_unit_ttl);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_CACHE_TTL, s_unit_ttl, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No cache TTL cached ...");
+    }
+
+    l = sizeof(s_rules);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_CACHE_RULE, s_rules, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No cache rule cached ...");
+    }
+
+    nvs_close(my_nvs_handle);
+}
+
+void mb_cache_save_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_CACHE_TTL, s_unit_ttl, sizeof(s_unit_ttl));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save cache TTL !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_CACHE_RULE, s_rules, sizeof(s_rules));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save cache rule !!!");
+
+    nvs_commit(my_nvs_handle);
+    nvs_close(my_nvs_handle);
+}
@@ -0,0 +1,54 @@
+#ifndef _MODBUS_CACHE_H
+#define _MODBUS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#define MB_CACHE_MAX_RULES 8
+
+typedef struct {
+    uint8_t uid;
+    uint8_t function; /* 3 or 4 */
+    uint16_t start;
+    uint16_t count;
+    uint16_t ttl_ms;
+} mb_cache_rule_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t stores;
+    uint32_t invalidations;
+} mb_cache_stats_t;
+
+esp_err_t mb_cache_init();
+
+/* Request / response are PDUs, response is written on a hit */
+bool mb_cache_lookup(uint8_t uid, const uint8_t *req, uint16_t req_len, uint8_t *rsp, uint16_t *rsp_len);
+void mb_cache_store(uint8_t uid, const uint8_t *req, uint16_t req_len, const uint8_t *rsp, uint16_t rsp_len);
+void mb_cache_invalidate(uint8_t uid, const uint8_t *req, uint16_t req_len);
+void mb_cache_invalidate_unit(uint8_t uid); /* Every entry of uid, its route changed */
+void mb_cache_clear();
+
+void mb_cache_set_unit_ttl(uint8_t uid, uint16_t ttl_ms);
+uint16_t mb_cache_get_unit_ttl(uint8_t uid);
+
+esp_err_t mb_cache_set_rule(const mb_cache_rule_t *rule); /* ttl_ms 0 removes the rule */
+const mb_cache_rule_t *mb_cache_get_rule(int index);
+
+void mb_cache_get_stats(mb_cache_stats_t *stats);
+
+void mb_cache_load_config();
+void mb_cache_save_config();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "nvs_flash.h"
+
+#include "sdkconfig.h"
+
+#include "modbus_data.h"
+#include "modbus_local.h"
+
+static const char *TAG = "mb_local";
+
+//
+// Local unit : the gateway's own register areas (modbus_data.h) are served
+// by the gateway listener for one unit ID, every other unit ID goes to the
+// buses. Requests are answered in place, in the caller's task, the register
+// map is the one the Modbus TCP slave used to expose on its own port.
+//
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_DATA_ADDRESS 0x02
+#define MB_EX_ILLEGAL_DATA_VALUE 0x03
+
+#define HOLD_OFFSET(field) ((uint16_t)(offsetof(holding_reg_params_t, field) >> 1))
+#define INPUT_OFFSET(field) ((uint16_t)(offsetof(input_reg_params_t, field) >> 1))
+
+typedef struct {
+    uint8_t *data; // Registers are little endian 16 bit words, bits are LSB first
+    uint16_t start;
+    uint16_t count; // Registers or bits
+} local_area_t;
+
+static const local_area_t s_holding = { (uint8_t *)&holding_reg_params.fp0, HOLD_OFFSET(fp0), (sizeof(float) << 2) / 2 };
+static const local_area_t s_input = { (uint8_t *)&input_reg_params.fp0, INPUT_OFFSET(fp0), (sizeof(float) << 2) / 2 };
+static const local_area_t s_coils = { (uint8_t *)&coil_reg_params, 0, sizeof(coil_reg_params) * 8 };
+static const local_area_t s_discrete = { (uint8_t *)&discrete_reg_params, 0, sizeof(discrete_reg_params) * 8 };
+
+static uint8_t s_local_uid = CONFIG_MB_GATEWAY_LOCAL_UNIT_ID;
+static SemaphoreHandle_t s_coils_written = NULL;
+
+static inline void _exception(mb_bus_txn_t *t, uint8_t code)
+{
+    t->pdu[0] |= 0x80;
+    t->pdu[1] = code;
+    t->pdu_len = 2;
+}
+
+static inline bool _in_area(const local_area_t *a, uint16_t start, uint16_t count)
+{
+    return start >= a->start && (uint32_t)start + count <= (uint32_t)a->start + a->count;
+}
+
+static inline bool _get_bit(const local_area_t *a, uint16_t addr)
+{
+    uint16_t i = addr - a->start;
+    return (a->data[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void _set_bit(const local_area_t *a, uint16_t addr, bool on)
+{
+    uint16_t i = addr - a->start;
+    if(on)
+        a->data[i >> 3] |= (1 << (i & 7));
+    else
+        a->data[i >> 3] &= ~(1 << (i & 7));
+}
+
+/* FC1, FC2 */
+static uint8_t _read_bits(mb_bus_txn_t *t, const local_area_t *a, uint16_t start, uint16_t count)
+{
+    if(t->pdu_len != 5 || count < 1 || count > 2000)
+        return MB_EX_ILLEGAL_DATA_VALUE;
+    if(_in_area(a, start, count) == false)
+        return MB_EX_ILLEGAL_DATA_ADDRESS;
+
+    uint8_t bytes = (count + 7) / 8;
+    memset(&t->pdu[2], 0, bytes);
+    for(int i=0; i<count; i++) {
+        if(_get_bit(a, start + i))
+            t->pdu[2 + i / 8] |= (1 << (i & 7));
+    }
+    t->pdu[1] = bytes;
+    t->pdu_len = 2 + bytes;
+
+    return 0;
+}
+
+/* FC3, FC4 */
+static uint8_t _read_registers(mb_bus_txn_t *t, const local_area_t *a, uint16_t start, uint16_t count)
+{
+    if(t->pdu_len != 5 || count < 1 || count > 125)
+        return MB_EX_ILLEGAL_DATA_VALUE;
+    if(_in_area(a, start, count) == false)
+        return MB_EX_ILLEGAL_DATA_ADDRESS;
+
+    const uint8_t *p = &a->data[(start - a->start) * 2];
+    for(int i=0; i<count; i++) {
+        t->pdu[2 + i * 2] = p[i * 2 + 1];
+        t->pdu[3 + i * 2] = p[i * 2];
+    }
+    t->pdu[1] = count * 2;
+    t->pdu_len = 2 + count * 2;
+
+    return 0;
+}
+
+/* FC5, FC15 */
+static uint8_t _write_coils(mb_bus_txn_t *t, uint16_t start, uint16_t count, const uint8_t *values)
+{
+    if(_in_area(&s_coils, start, count) == false)
+        return MB_EX_ILLEGAL_DATA_ADDRESS;
+
+    for(int i=0; i<count; i++)
+        _set_bit(&s_coils, start + i, (values[i / 8] >> (i & 7)) & 1);
+
+    if(s_coils_written)
+        xSemaphoreGive(s_coils_written);
+
+    t->pdu_len = 5; /* Echo of the address and the quantity or value */
+
+    return 0;
+}
+
+/* FC6, FC16, values as on the wire */
+static uint8_t _write_registers(mb_bus_txn_t *t, uint16_t start, uint16_t count, const uint8_t *values)
+{
+    if(_in_area(&s_holding, start, count) == false)
+        return MB_EX_ILLEGAL_DATA_ADDRESS;
+
+    uint8_t *p = &s_holding.data[(start - s_holding.start) * 2];
+    for(int i=0; i<count; i++) {
+        p[i * 2] = values[i * 2 + 1];
+        p[i * 2 + 1] = values[i * 2];
+    }
+
+    t->pdu_len = 5;
+
+    return 0;
+}
+
+static uint8_t _process(mb_bus_txn_t *t)
+{
+    if(t->pdu_len < 5)
+        return (t->pdu[0] >= 1 && t->pdu[0] <= 16) ? MB_EX_ILLEGAL_DATA_VALUE : MB_EX_ILLEGAL_FUNCTION;
+
+    uint16_t start = (t->pdu[1] << 8) + t->pdu[2];
+    uint16_t value = (t->pdu[3] << 8) + t->pdu[4]; /* Quantity, or the value of a single write */
+
+    switch(t->pdu[0]) {
+        case 1:
+            return _read_bits(t, &s_coils, start, value);
+        case 2:
+            return _read_bits(t, &s_discrete, start, value);
+        case 3:
+            return _read_registers(t, &s_holding, start, value);
+        case 4:
+            return _read_registers(t, &s_input, start, value);
+        case 5: {
+            if(t->pdu_len != 5 || (value != 0xff00 && value != 0x0000))
+                return MB_EX_ILLEGAL_DATA_VALUE;
+            uint8_t on = (value == 0xff00);
+            return _write_coils(t, start, 1, &on);
+        }
+        case 6:
+            if(t->pdu_len != 5)
+                return MB_EX_ILLEGAL_DATA_VALUE;
+            return _write_registers(t, start, 1, &t->pdu[3]);
+        case 15:
+            if(value < 1 || value > 1968 || t->pdu_len < 6 || t->pdu[5] != (value + 7) / 8 || t->pdu_len != 6 + t->pdu[5])
+                return MB_EX_ILLEGAL_DATA_VALUE;
+            return _write_coils(t, start, value, &t->pdu[6]);
+        case 16:
+            if(value < 1 || value > 123 || t->pdu_len < 6 || t->pdu[5] != value * 2 || t->pdu_len != 6 + t->pdu[5])
+                return MB_EX_ILLEGAL_DATA_VALUE;
+            return _write_registers(t, start, value, &t->pdu[6]);
+        default:
+            return MB_EX_ILLEGAL_FUNCTION;
+    }
+}
+
+void mb_local_init(SemaphoreHandle_t coils_written)
+{
+    s_coils_written = coils_written;
+
+    mb_local_load_config();
+}
+
+bool mb_local_submit(mb_bus_txn_t *t)
+{
+    if(s_local_uid == MB_LOCAL_UID_DISABLE || t->uid != s_local_uid)
+        return false;
+
+    uint8_t ex = _process(t);
+    if(ex) {
+        ESP_LOGW(TAG, "FC%u refused with exception %u", t->pdu[0], ex);
+        _exception(t, ex);
+    }
+
+    t->done(t);
+
+    return true;
+}
+
+void mb_local_set_uid(uint8_t uid)
+{
+    s_local_uid = uid;
+}
+
+uint8_t mb_local_get_uid()
+{
+    return s_local_uid;
+}
+
+static nvs_handle my_nvs_handle;
+
+#define CMD_MB_LOCAL_UID "mb_local_uid"
+
+void mb_local_load_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    size_t l = sizeof(s_local_uid);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_LOCAL_UID, &s_local_uid, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No local unit ID cached ...");
+    }
+
+    nvs_close(my_nvs_handle);
+}
+
+void mb_local_save_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_LOCAL_UID, &s_local_uid, sizeof(s_local_uid));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save local unit ID !!!");
+
+    nvs_commit(my_nvs_handle);
+    nvs_close(my_nvs_handle);
+}
@@ -0,0 +1,34 @@
+#ifndef _MODBUS_LOCAL_H
+#define _MODBUS_LOCAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "modbus_bus.h"
+
+#define MB_LOCAL_UID_DISABLE 0 /* Every unit ID goes to RS485 */
+
+/* coils_written is given after a master changed the coils (may be NULL) */
+void mb_local_init(SemaphoreHandle_t coils_written);
+
+/* Serves t from the gateway's own register areas when t->uid is the local unit ID, t->done is called before it returns */
+bool mb_local_submit(mb_bus_txn_t *t);
+
+void mb_local_set_uid(uint8_t uid);
+uint8_t mb_local_get_uid();
+
+void mb_local_load_config();
+void mb_local_save_config();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
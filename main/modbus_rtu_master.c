@@ -1,42 +1,31 @@
 #include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "nvs_flash.h"
 
 //#include "modbus_params.h"  // for modbus parameters structures
-#include "mbcontroller.h"
+#include "mbcontroller.h" // Parameter descriptor types only, the bus owns the UART
 #include "modbus_data.h"
 
 #include "sdkconfig.h"
 
+#include "esp32_malloc.h"
+#include "modbus_bus.h"
 #include "modbus_rtu_master.h"
 
-#define MB_PORT_NUM     (CONFIG_MB_UART_PORT_NUM)   // Number of UART port used for Modbus connection
-#define MB_DEV_SPEED    (CONFIG_MB_UART_BAUD_RATE)  // The communication speed of the UART
-
-// Note: Some pins on target chip cannot be assigned for UART communication.
-// See UART documentation for selected board and target to configure pins using Kconfig.
-
 // The number of parameters that intended to be used in the particular control process
 //#define MASTER_MAX_CIDS num_device_parameters
 
-// Number of reading of parameters from slave
-#define MASTER_MAX_RETRY 30
-
-// Timeout to update cid over Modbus
+// Period to update cid over Modbus
 #define UPDATE_CIDS_TIMEOUT_MS          (500)
 #define UPDATE_CIDS_TIMEOUT_TICS        (UPDATE_CIDS_TIMEOUT_MS / portTICK_RATE_MS)
 
-// Timeout between polls
-#define POLL_TIMEOUT_MS                 (1)
-#define POLL_TIMEOUT_TICS               (POLL_TIMEOUT_MS / portTICK_RATE_MS)
-
 #define TAG "RTU_MASTER"
 
-#define MASTER_CHECK(a, ret_val, str, ...) \
-    if (!(a)) { \
-        ESP_LOGE(TAG, "%s(%u): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
-        return (ret_val); \
-    }
-
 // The macro to get offset for parameter in the appropriate structure
 #define HOLD_OFFSET(field) ((uint16_t)(offsetof(holding_reg_params_t, field) + 1))
 #define INPUT_OFFSET(field) ((uint16_t)(offsetof(input_reg_params_t, field) + 1))
@@ -157,6 +146,7 @@ const mb_parameter_descriptor_t device_parameters[] = {
 // const uint16_t num_device_parameters = (sizeof(device_parameters)/sizeof(device_parameters[0]));
 static uint16_t num_device_parameters = 0;
 
+#if CONFIG_MB_GATEWAY_POLL_CIDS
 // The function to get pointer to parameter storage (instance) according to parameter description table
 static void* master_get_param_data(const mb_parameter_descriptor_t* param_descriptor)
 {
@@ -187,137 +177,698 @@ static void* master_get_param_data(const mb_parameter_descriptor_t* param_descri
     }
     return instance_ptr;
 }
+#endif
 
-// User operation function to read slave values and check alarm
-static void master_operation_func(void *arg)
+//
+// Scan list : ranges polled continuously into a shadow map kept in PSRAM.
+// Gateway reads falling inside a fresh range are answered from the shadow
+// without touching the bus.
+//
+// Polls are scheduled earliest deadline first. The poller keeps out of the
+// bus long enough after each read to stay within its utilization budget, and
+// a range answering the same data SCAN_STABLE_POLLS times in a row has its
+// period doubled, up to CONFIG_MB_GATEWAY_POLL_SLOWDOWN_MAX times the
+// configured interval. Any change, or a gateway write over it, restores it.
+// The shadow is served only while younger than twice the configured interval,
+// a slowed down range goes back to the bus for the reads in between.
+//
+#define SCAN_BITS_MAX 2000
+#define SCAN_REGS_MAX 125
+
+#define SCAN_STABLE_POLLS 4
+
+typedef struct {
+    uint32_t stamp; // Tick of acquisition
+    uint32_t next_tick; // Next poll due
+    uint32_t period_ms; // Current poll period, interval_ms or slowed down
+    uint16_t len; // Response PDU length, 0 while nothing valid
+    uint16_t stable; // Consecutive polls with unchanged data
+    uint8_t *pdu; // Function, byte count, data
+} scan_shadow_t;
+
+static mb_scan_entry_t s_scan[MB_SCAN_MAX_ENTRIES];
+static scan_shadow_t s_shadow[MB_SCAN_MAX_ENTRIES];
+static xSemaphoreHandle s_shadow_mutex = NULL;
+static mb_scan_stats_t s_scan_stats = { 0 };
+
+static uint8_t s_poll_budget = CONFIG_MB_GATEWAY_POLL_BUDGET; // Percent of bus time
+static TickType_t s_budget_tick; // The budget allows the next poll from then on
+static TaskHandle_t s_poll_task = NULL;
+
+// The poller is one more client of the RS485 bus, one request at a time
+static mb_bus_client_t s_poll_client;
+static mb_bus_txn_t s_poll_txn;
+static xSemaphoreHandle s_poll_done;
+
+static void _poll_txn_done(mb_bus_txn_t *t)
+{
+    xSemaphoreGive(s_poll_done);
+}
+
+/* Reads a range through the bus, on success the answer PDU is left in s_poll_txn */
+static esp_err_t _poll_read(uint8_t uid, uint8_t function, uint16_t start, uint16_t count)
+{
+    mb_bus_txn_t *t = &s_poll_txn;
+
+    t->client = &s_poll_client;
+    t->done = _poll_txn_done;
+    t->flags = MB_BUS_TXN_FRESH | MB_BUS_TXN_BACKGROUND;
+    t->uid = uid;
+    t->pdu[0] = function;
+    t->pdu[1] = start >> 8;
+    t->pdu[2] = start & 0xff;
+    t->pdu[3] = count >> 8;
+    t->pdu[4] = count & 0xff;
+    t->pdu_len = 5;
+
+    TickType_t begin = xTaskGetTickCount();
+
+    mb_bus_submit(t);
+    xSemaphoreTake(s_poll_done, portMAX_DELAY);
+
+    /*
+     * Time spent queued behind gateway traffic is charged too, so the poller
+     * backs off further while the bus is busy
+     */
+    TickType_t busy = xTaskGetTickCount() - begin;
+    if(busy == 0)
+        busy = 1;
+    s_budget_tick = xTaskGetTickCount() + busy * (100 - s_poll_budget) / s_poll_budget;
+
+    uint16_t bytes = (function <= 2) ? (count + 7) / 8 : count * 2;
+    if(t->pdu[0] != function || t->pdu_len != 2 + bytes || t->pdu[1] != bytes)
+        return ESP_ERR_INVALID_RESPONSE;
+
+    return ESP_OK;
+}
+
+static inline bool _scan_valid(const mb_scan_entry_t *e)
+{
+    if(e->function < 1 || e->function > 4 || e->count == 0)
+        return false;
+    return e->count <= ((e->function <= 2) ? SCAN_BITS_MAX : SCAN_REGS_MAX);
+}
+
+/*
+ * Shadow older than two configured intervals is not served, whether polling
+ * stalled or slowed down on a stable range, let the request through
+ */
+static inline bool _shadow_fresh(const mb_scan_entry_t *e, const scan_shadow_t *sh, uint32_t now)
+{
+    return sh->len != 0 && (now - sh->stamp) * portTICK_PERIOD_MS <= 2 * e->interval_ms;
+}
+
+static inline void _shadow_reset(const mb_scan_entry_t *e, scan_shadow_t *sh)
+{
+    sh->len = 0;
+    sh->stable = 0;
+    sh->period_ms = e->interval_ms;
+    sh->next_tick = xTaskGetTickCount();
+}
+
+static inline void _poll_wake()
+{
+    if(s_poll_task)
+        xTaskNotifyGive(s_poll_task);
+}
+
+static void _scan_poll(int i)
+{
+    mb_scan_entry_t *e = &s_scan[i];
+    scan_shadow_t *sh = &s_shadow[i];
+
+    /* A write bumps the generation before it invalidates, broadcasts and route changes too */
+    uint32_t gen = mb_bus_write_gen(e->uid);
+
+    esp_err_t err = _poll_read(e->uid, e->function, e->start, e->count);
+
+    uint32_t now = xTaskGetTickCount();
+
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+    s_scan_stats.polls++;
+    if(gen != mb_bus_write_gen(e->uid)) {
+        /* Overtaken by a write, the answer may predate it, the range is due again right away */
+        xSemaphoreGive(s_shadow_mutex);
+        return;
+    }
+    if(err == ESP_OK) {
+        if(sh->len == s_poll_txn.pdu_len && memcmp(sh->pdu, s_poll_txn.pdu, sh->len) == 0) {
+            if(++sh->stable >= SCAN_STABLE_POLLS &&
+                sh->period_ms < e->interval_ms * CONFIG_MB_GATEWAY_POLL_SLOWDOWN_MAX) {
+                sh->period_ms *= 2;
+                if(sh->period_ms > e->interval_ms * CONFIG_MB_GATEWAY_POLL_SLOWDOWN_MAX)
+                    sh->period_ms = e->interval_ms * CONFIG_MB_GATEWAY_POLL_SLOWDOWN_MAX;
+                sh->stable = 0;
+            }
+        } else {
+            sh->stable = 0;
+            sh->period_ms = e->interval_ms;
+            memcpy(sh->pdu, s_poll_txn.pdu, s_poll_txn.pdu_len);
+            sh->len = s_poll_txn.pdu_len;
+        }
+        sh->stamp = now;
+    } else
+        s_scan_stats.errors++;
+
+    /* Keep the phase, unless a whole period was missed */
+    int32_t lag = now - sh->next_tick;
+    if(lag >= 0 && lag * portTICK_PERIOD_MS >= sh->period_ms) {
+        s_scan_stats.late++;
+        sh->next_tick = now;
+    }
+    sh->next_tick += pdMS_TO_TICKS(sh->period_ms);
+    xSemaphoreGive(s_shadow_mutex);
+}
+
+/* Scan entry with the earliest deadline, -1 if the list is empty */
+static int _scan_earliest()
+{
+    int earliest = -1;
+
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+        if(s_scan[i].interval_ms == 0)
+            continue;
+        if(earliest < 0 || (int32_t)(s_shadow[i].next_tick - s_shadow[earliest].next_tick) < 0)
+            earliest = i;
+    }
+    xSemaphoreGive(s_shadow_mutex);
+
+    return earliest;
+}
+
+bool mb_scan_lookup(uint8_t uid, const uint8_t *req, uint16_t req_len, uint8_t *rsp, uint16_t *rsp_len)
+{
+    if(s_shadow_mutex == NULL || req_len != 5 || req[0] < 1 || req[0] > 4)
+        return false;
+
+    uint8_t function = req[0];
+    uint16_t start = (req[1] << 8) + req[2];
+    uint16_t count = (req[3] << 8) + req[4];
+    if(count == 0 || count > ((function <= 2) ? SCAN_BITS_MAX : SCAN_REGS_MAX))
+        return false;
+
+    bool hit = false;
+    uint32_t now = xTaskGetTickCount();
+
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES && hit == false; i++) {
+        const mb_scan_entry_t *e = &s_scan[i];
+        const scan_shadow_t *sh = &s_shadow[i];
+        if(e->interval_ms == 0 || e->uid != uid || e->function != function)
+            continue;
+        if(start < e->start || (uint32_t)start + count > (uint32_t)e->start + e->count)
+            continue;
+        if(_shadow_fresh(e, sh, now) == false)
+            continue;
+
+        uint16_t offset = start - e->start;
+        rsp[0] = function;
+        if(function <= 2) { /* Bits, realign on the requested start */
+            uint16_t bytes = (count + 7) / 8;
+            memset(&rsp[2], 0, bytes);
+            for(uint16_t b=0; b<count; b++) {
+                uint16_t src = offset + b;
+                if(sh->pdu[2 + src / 8] & (1 << (src % 8)))
+                    rsp[2 + b / 8] |= 1 << (b % 8);
+            }
+            rsp[1] = bytes;
+        } else {
+            rsp[1] = count * 2;
+            memcpy(&rsp[2], &sh->pdu[2 + offset * 2], count * 2);
+        }
+        *rsp_len = 2 + rsp[1];
+        hit = true;
+    }
+
+    if(hit)
+        s_scan_stats.hits++;
+
+    xSemaphoreGive(s_shadow_mutex);
+
+    return hit;
+}
+
+/* A gateway write overlapping a scanned range makes it stale until polled again, right away */
+void mb_scan_invalidate(uint8_t uid, const uint8_t *req, uint16_t req_len)
+{
+    uint8_t function; /* Read function of the area written */
+    uint16_t start, count;
+
+    if(s_shadow_mutex == NULL || req_len < 3)
+        return;
+
+    switch(req[0]) {
+        case 5: /* Write single coil */
+            function = 1;
+            start = (req[1] << 8) + req[2];
+            count = 1;
+            break;
+        case 6: /* Write single register */
+        case 22: /* Mask write register */
+            function = 3;
+            start = (req[1] << 8) + req[2];
+            count = 1;
+            break;
+        case 15: /* Write multiple coils */
+        case 16: /* Write multiple registers */
+            if(req_len < 5)
+                return;
+            function = (req[0] == 15) ? 1 : 3;
+            start = (req[1] << 8) + req[2];
+            count = (req[3] << 8) + req[4];
+            break;
+        case 23: /* Read / write multiple registers */
+            if(req_len < 9)
+                return;
+            function = 3;
+            start = (req[5] << 8) + req[6];
+            count = (req[7] << 8) + req[8];
+            break;
+        default:
+            return;
+    }
+
+    bool stale = false;
+
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+        const mb_scan_entry_t *e = &s_scan[i];
+        if(e->interval_ms == 0 || e->function != function || (uid != 0 && e->uid != uid)) /* Unit 0 is broadcast */
+            continue;
+        if((uint32_t)e->start + e->count <= start || (uint32_t)start + count <= e->start)
+            continue;
+        _shadow_reset(e, &s_shadow[i]);
+        stale = true;
+    }
+
+    xSemaphoreGive(s_shadow_mutex);
+
+    if(stale)
+        _poll_wake();
+}
+
+void mb_scan_invalidate_unit(uint8_t uid)
+{
+    bool stale = false;
+
+    if(s_shadow_mutex == NULL)
+        return;
+
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+        const mb_scan_entry_t *e = &s_scan[i];
+        if(e->interval_ms == 0 || e->uid != uid)
+            continue;
+        _shadow_reset(e, &s_shadow[i]);
+        stale = true;
+    }
+    xSemaphoreGive(s_shadow_mutex);
+
+    if(stale)
+        _poll_wake();
+}
+
+esp_err_t mb_scan_set_entry(int index, const mb_scan_entry_t *entry)
+{
+    if(index < 0 || index >= MB_SCAN_MAX_ENTRIES)
+        return ESP_ERR_INVALID_ARG;
+    if(entry->interval_ms != 0 && _scan_valid(entry) == false)
+        return ESP_ERR_INVALID_ARG;
+
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+    s_scan[index] = *entry;
+    _shadow_reset(entry, &s_shadow[index]);
+    xSemaphoreGive(s_shadow_mutex);
+
+    _poll_wake();
+
+    return ESP_OK;
+}
+
+const mb_scan_entry_t *mb_scan_get_entry(int index)
+{
+    if(index < 0 || index >= MB_SCAN_MAX_ENTRIES || s_scan[index].interval_ms == 0)
+        return NULL;
+    return &s_scan[index];
+}
+
+uint32_t mb_scan_get_period(int index)
+{
+    if(index < 0 || index >= MB_SCAN_MAX_ENTRIES || s_scan[index].interval_ms == 0)
+        return 0;
+    return s_shadow[index].period_ms;
+}
+
+esp_err_t mb_scan_set_budget(uint8_t percent)
+{
+    if(percent < 1 || percent > 100)
+        return ESP_ERR_INVALID_ARG;
+    s_poll_budget = percent;
+    return ESP_OK;
+}
+
+uint8_t mb_scan_get_budget()
+{
+    return s_poll_budget;
+}
+
+void mb_scan_get_stats(mb_scan_stats_t *stats)
+{
+    xSemaphoreTake(s_shadow_mutex, portMAX_DELAY);
+    memcpy(stats, &s_scan_stats, sizeof(mb_scan_stats_t));
+    xSemaphoreGive(s_shadow_mutex);
+}
+
+static nvs_handle my_nvs_handle;
+
+#define CMD_MB_SCAN "mb_scan"
+#define CMD_MB_SCAN_BUDGET "mb_scan_budget"
+
+void mb_scan_load_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    size_t l = sizeof(s_scan);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_SCAN, s_scan, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No scan list cached ...");
+    }
+
+    l = sizeof(s_poll_budget);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_SCAN_BUDGET, &s_poll_budget, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No poll budget cached ...");
+    }
+
+    nvs_close(my_nvs_handle);
+
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+        if(s_scan[i].interval_ms != 0 && _scan_valid(&s_scan[i]) == false)
+            s_scan[i].interval_ms = 0;
+    }
+    if(s_poll_budget < 1 || s_poll_budget > 100)
+        s_poll_budget = CONFIG_MB_GATEWAY_POLL_BUDGET;
+}
+
+void mb_scan_save_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_SCAN, s_scan, sizeof(s_scan));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save scan list !!!");
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_SCAN_BUDGET, &s_poll_budget, sizeof(s_poll_budget));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save poll budget !!!");
+
+    nvs_commit(my_nvs_handle);
+    nvs_close(my_nvs_handle);
+}
+
+#if CONFIG_MB_GATEWAY_POLL_CIDS
+static uint8_t _cid_function(const mb_parameter_descriptor_t *param_descriptor)
+{
+    switch(param_descriptor->mb_param_type) {
+        case MB_PARAM_COIL: return 1;
+        case MB_PARAM_DISCRETE: return 2;
+        case MB_PARAM_HOLDING: return 3;
+        case MB_PARAM_INPUT: return 4;
+        default: return 0;
+    }
+}
+
+//
+// Characteristics on the same slave and register type within
+// CONFIG_MB_GATEWAY_COALESCE_GAP registers of each other are read as one
+// block, built once at startup, and scattered into their instances. A block
+// refused with an illegal data address spans a gap the slave does not map,
+// its characteristics are read one by one from then on.
+//
+#define MB_EX_ILLEGAL_DATA_ADDRESS 0x02
+
+#define CID_TABLE_SIZE (sizeof(device_parameters) / sizeof(device_parameters[0]))
+
+typedef struct {
+    uint8_t uid;
+    uint8_t function;
+    uint16_t start;
+    uint16_t count;
+    uint16_t first; // Index of the first characteristic in s_cid_order
+    uint16_t num;
+    bool split; // Not mergeable, read per characteristic
+} cid_block_t;
+
+static uint16_t s_cid_order[CID_TABLE_SIZE]; // Table indexes sorted by slave, type, register
+static cid_block_t s_cid_blocks[CID_TABLE_SIZE];
+static uint16_t s_num_cid_blocks = 0;
+
+static int _cid_compare(const mb_parameter_descriptor_t *a, const mb_parameter_descriptor_t *b)
+{
+    if(a->mb_slave_addr != b->mb_slave_addr)
+        return a->mb_slave_addr - b->mb_slave_addr;
+    if(_cid_function(a) != _cid_function(b))
+        return _cid_function(a) - _cid_function(b);
+    return a->mb_reg_start - b->mb_reg_start;
+}
+
+static void master_build_blocks()
+{
+    uint16_t n = 0;
+
+    for(uint16_t cid = 0; cid < num_device_parameters; cid++) {
+        if(_cid_function(&device_parameters[cid]) == 0 || device_parameters[cid].mb_size == 0) {
+            ESP_LOGE(TAG, "Characteristic #%d (%s) not readable, skipped.", device_parameters[cid].cid,
+                (char*)device_parameters[cid].param_key);
+            continue;
+        }
+        uint16_t j = n++;
+        while(j > 0 && _cid_compare(&device_parameters[s_cid_order[j - 1]], &device_parameters[cid]) > 0) {
+            s_cid_order[j] = s_cid_order[j - 1];
+            j--;
+        }
+        s_cid_order[j] = cid;
+    }
+
+    s_num_cid_blocks = 0;
+    cid_block_t *k = NULL;
+
+    for(uint16_t i = 0; i < n; i++) {
+        const mb_parameter_descriptor_t *d = &device_parameters[s_cid_order[i]];
+        uint8_t function = _cid_function(d);
+        uint32_t end = (uint32_t)d->mb_reg_start + d->mb_size;
+        uint32_t max = (function <= 2) ? SCAN_BITS_MAX : SCAN_REGS_MAX;
+
+        if(k && k->uid == d->mb_slave_addr && k->function == function &&
+            d->mb_reg_start <= (uint32_t)k->start + k->count + CONFIG_MB_GATEWAY_COALESCE_GAP &&
+            (end > (uint32_t)k->start + k->count ? end : (uint32_t)k->start + k->count) - k->start <= max) {
+            if(end > (uint32_t)k->start + k->count)
+                k->count = end - k->start;
+            k->num++;
+            continue;
+        }
+
+        k = &s_cid_blocks[s_num_cid_blocks++];
+        k->uid = d->mb_slave_addr;
+        k->function = function;
+        k->start = d->mb_reg_start;
+        k->count = d->mb_size;
+        k->first = i;
+        k->num = 1;
+        k->split = false;
+    }
+
+    ESP_LOGI(TAG, "%d characteristics read in %d blocks", n, s_num_cid_blocks);
+}
+
+/* Copies a characteristic out of the block answer, registers in host order as the esp-modbus master did */
+static void master_scatter_cid(const cid_block_t *k, const mb_parameter_descriptor_t *param_descriptor, const uint8_t *data)
+{
+    uint8_t *instance = (uint8_t *)master_get_param_data(param_descriptor);
+    uint16_t offset = param_descriptor->mb_reg_start - k->start;
+
+    if(k->function <= 2) {
+        uint16_t bytes = (param_descriptor->mb_size + 7) / 8;
+        if(bytes > param_descriptor->param_size)
+            bytes = param_descriptor->param_size;
+        memset(instance, 0, bytes);
+        for(uint16_t b=0; b<param_descriptor->mb_size && b / 8 < bytes; b++) {
+            uint16_t src = offset + b;
+            if(data[src / 8] & (1 << (src % 8)))
+                instance[b / 8] |= 1 << (b % 8);
+        }
+    } else {
+        uint16_t bytes = param_descriptor->mb_size * 2;
+        if(bytes > param_descriptor->param_size)
+            bytes = param_descriptor->param_size;
+        data += offset * 2;
+        for(uint16_t i=0; i + 1 < bytes; i += 2) {
+            uint16_t reg = (data[i] << 8) | data[i + 1];
+            memcpy(&instance[i], &reg, 2);
+        }
+    }
+}
+
+/* One characteristic alone, as if it were a block of its own */
+static esp_err_t master_read_cid(const cid_block_t *k, const mb_parameter_descriptor_t *param_descriptor)
+{
+    cid_block_t one = { k->uid, k->function, param_descriptor->mb_reg_start, param_descriptor->mb_size, 0, 1, false };
+
+    esp_err_t err = _poll_read(one.uid, one.function, one.start, one.count);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Characteristic #%d (%s) read fail, err = 0x%x (%s).",
+                        param_descriptor->cid,
+                        (char*)param_descriptor->param_key,
+                        (int)err,
+                        (char*)esp_err_to_name(err));
+        return err;
+    }
+
+    master_scatter_cid(&one, param_descriptor, &s_poll_txn.pdu[2]);
+
+    return ESP_OK;
+}
+
+static esp_err_t master_read_block(cid_block_t *k)
 {
     esp_err_t err = ESP_OK;
-    float value = 0;
-    bool alarm_state = false;
-    const mb_parameter_descriptor_t* param_descriptor = NULL;
+
+    if(k->split == false) {
+        err = _poll_read(k->uid, k->function, k->start, k->count);
+        if(err != ESP_OK && k->num > 1 &&
+            s_poll_txn.pdu[0] == (k->function | 0x80) && s_poll_txn.pdu[1] == MB_EX_ILLEGAL_DATA_ADDRESS) {
+            ESP_LOGW(TAG, "Unit %d FC%d %d - %d not mapped as a whole, %d characteristics read one by one.",
+                            k->uid, k->function, k->start, k->start + k->count - 1, k->num);
+            k->split = true;
+        } else if(err != ESP_OK)
+            return err;
+    }
+
+    if(k->split) {
+        err = ESP_OK;
+        for(uint16_t i = 0; i < k->num; i++) {
+            esp_err_t e = master_read_cid(k, &device_parameters[s_cid_order[k->first + i]]);
+            if(e != ESP_OK)
+                err = e;
+        }
+        return err;
+    }
+
+    for(uint16_t i = 0; i < k->num; i++) {
+        const mb_parameter_descriptor_t *param_descriptor = &device_parameters[s_cid_order[k->first + i]];
+        master_scatter_cid(k, param_descriptor, &s_poll_txn.pdu[2]);
+        ESP_LOGD(TAG, "Characteristic #%d %s (%s) read successful.",
+                        param_descriptor->cid,
+                        (char*)param_descriptor->param_key,
+                        (char*)param_descriptor->param_units);
+    }
+
+    return ESP_OK;
+}
+#endif
+
+// User operation function to read slave values
+static void master_operation_func(void *arg)
+{
+    TickType_t next_cids = xTaskGetTickCount();
 
     ESP_LOGI(TAG, "Start modbus RTU master ...");
 
-    //for(uint16_t retry = 0; retry <= MASTER_MAX_RETRY && (!alarm_state); retry++) {
     for(;;) {
-        // Read all found characteristics from slave(s)
-        for (uint16_t cid = 0; (err != ESP_ERR_NOT_FOUND) && cid < num_device_parameters; cid++)
-        {
-            // Get data from parameters description table
-            // and use this information to fill the characteristics description table
-            // and having all required fields in just one table
-            err = mbc_master_get_cid_info(cid, &param_descriptor);
-            if ((err != ESP_ERR_NOT_FOUND) && (param_descriptor != NULL)) {
-                void* temp_data_ptr = master_get_param_data(param_descriptor);
-                assert(temp_data_ptr);
-                uint8_t type = 0;
-                {
-                    err = mbc_master_get_parameter(cid, (char*)param_descriptor->param_key,
-                                                        (uint8_t*)&value, &type);
-                    if (err == ESP_OK) {
-                        *(float*)temp_data_ptr = value;
-                        if ((param_descriptor->mb_param_type == MB_PARAM_HOLDING) ||
-                            (param_descriptor->mb_param_type == MB_PARAM_INPUT)) {
-                            ESP_LOGI(TAG, "Characteristic #%d %s (%s) value = %f (0x%x) read successful.",
-                                            param_descriptor->cid,
-                                            (char*)param_descriptor->param_key,
-                                            (char*)param_descriptor->param_units,
-                                            value,
-                                            *(uint32_t*)temp_data_ptr);
-                            if (((value > param_descriptor->param_opts.max) ||
-                                (value < param_descriptor->param_opts.min))) {
-                                    alarm_state = true;
-                                    break;
-                            }
-                        } else {
-                            uint16_t state = *(uint16_t*)temp_data_ptr;
-                            const char* rw_str = (state & param_descriptor->param_opts.opt1) ? "ON" : "OFF";
-                            ESP_LOGI(TAG, "Characteristic #%d %s (%s) value = %s (0x%x) read successful.",
-                                            param_descriptor->cid,
-                                            (char*)param_descriptor->param_key,
-                                            (char*)param_descriptor->param_units,
-                                            (const char*)rw_str,
-                                            *(uint16_t*)temp_data_ptr);
-                            if (state & param_descriptor->param_opts.opt1) {
-                                alarm_state = true;
-                                break;
-                            }
-                        }
-                    } else {
-                        ESP_LOGE(TAG, "Characteristic #%d (%s) read fail, err = 0x%x (%s).",
-                                            param_descriptor->cid,
-                                            (char*)param_descriptor->param_key,
-                                            (int)err,
-                                            (char*)esp_err_to_name(err));
-                    }
+        TickType_t now = xTaskGetTickCount();
+
+        /* Give the gateway its share of the bus first */
+        if((int32_t)(s_budget_tick - now) > 0) {
+            vTaskDelay(s_budget_tick - now);
+            continue;
+        }
+
+        int i = _scan_earliest();
+        TickType_t deadline = (i < 0) ? now + UPDATE_CIDS_TIMEOUT_TICS : s_shadow[i].next_tick;
+
+#if CONFIG_MB_GATEWAY_POLL_CIDS
+        if((int32_t)(next_cids - deadline) <= 0) {
+            if((int32_t)(next_cids - now) > 0) {
+                ulTaskNotifyTake(pdTRUE, next_cids - now);
+                continue;
+            }
+            // Read all characteristics from slave(s), the budget applies between blocks
+            for (uint16_t i = 0; i < s_num_cid_blocks; i++) {
+                cid_block_t *k = &s_cid_blocks[i];
+                esp_err_t err = master_read_block(k);
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Unit %d FC%d %d - %d (%d characteristics) read fail, err = 0x%x (%s).",
+                                    k->uid, k->function, k->start, k->start + k->count - 1, k->num,
+                                    (int)err,
+                                    (char*)esp_err_to_name(err));
                 }
-                vTaskDelay(POLL_TIMEOUT_TICS); // timeout between polls
+                if((int32_t)(s_budget_tick - xTaskGetTickCount()) > 0)
+                    vTaskDelay(s_budget_tick - xTaskGetTickCount());
             }
+            next_cids += UPDATE_CIDS_TIMEOUT_TICS;
+            if((int32_t)(xTaskGetTickCount() - next_cids) >= 0)
+                next_cids = xTaskGetTickCount() + UPDATE_CIDS_TIMEOUT_TICS;
+            continue;
         }
-        vTaskDelay(UPDATE_CIDS_TIMEOUT_TICS); //
+#else
+        (void)next_cids;
+#endif
+
+        if(i < 0 || (int32_t)(deadline - now) > 0) {
+            /* A new entry or a write wakes us up earlier */
+            ulTaskNotifyTake(pdTRUE, deadline - now);
+            continue;
+        }
+
+        _scan_poll(i);
     }
+}
 
-    if (alarm_state) {
-        ESP_LOGI(TAG, "Alarm triggered by cid #%d.",
-                                        param_descriptor->cid);
-    } else {
-        ESP_LOGE(TAG, "Alarm is not triggered after %d retries.",
-                                        MASTER_MAX_RETRY);
+// Poller state, created before the console may reach it through mb_scan_*()
+void initialize_modbus_rtu_master()
+{
+    s_shadow_mutex = xSemaphoreCreateMutex();
+    s_poll_done = xSemaphoreCreateBinary();
+    s_budget_tick = xTaskGetTickCount();
+    mb_bus_client_init(&s_poll_client, 1);
+
+    mb_scan_load_config();
+
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+        s_shadow[i].pdu = (uint8_t *)esp32_malloc(MB_PDU_SIZE_MAX);
+        if(s_shadow[i].pdu == NULL) {
+            ESP_LOGE(TAG, "No memory for the shadow map !!!");
+            return;
+        }
+        _shadow_reset(&s_scan[i], &s_shadow[i]);
     }
-    ESP_LOGI(TAG, "Destroy master...");
-    ESP_ERROR_CHECK(mbc_master_destroy());
 }
 
-// Modbus master initialization
+// Poller initialization, the RS485 port itself belongs to the bus
 static esp_err_t master_init(void)
 {
-    // Initialize and start Modbus controller
-    mb_communication_info_t comm = {
-            .port = MB_PORT_NUM,
-#if CONFIG_MB_COMM_MODE_ASCII
-            .mode = MB_MODE_ASCII,
-#elif CONFIG_MB_COMM_MODE_RTU
-            .mode = MB_MODE_RTU,
-#endif
-            .baudrate = MB_DEV_SPEED,
-            .parity = MB_PARITY_NONE
-    };
-    void* master_handler = NULL;
-
-    esp_err_t err = mbc_master_init(MB_PORT_SERIAL_MASTER, &master_handler);
-    MASTER_CHECK((master_handler != NULL), ESP_ERR_INVALID_STATE,
-                                "mb controller initialization fail.");
-    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                            "mb controller initialization fail, returns(0x%x).",
-                            (uint32_t)err);
-    err = mbc_master_setup((void*)&comm);
-    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                            "mb controller setup fail, returns(0x%x).",
-                            (uint32_t)err);
-
-    // Set UART pin numbers
-    err = uart_set_pin(MB_PORT_NUM, CONFIG_MB_UART_TXD, CONFIG_MB_UART_RXD,
-                              CONFIG_MB_UART_RTS, UART_PIN_NO_CHANGE);
-
-    err = mbc_master_start();
-    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                            "mb controller start fail, returns(0x%x).",
-                            (uint32_t)err);
-
-    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-            "mb serial set pin failure, uart_set_pin() returned (0x%x).", (uint32_t)err);
-    // Set driver mode to Half Duplex
-    err = uart_set_mode(MB_PORT_NUM, UART_MODE_RS485_HALF_DUPLEX);
-    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-            "mb serial set mode failure, uart_set_mode() returned (0x%x).", (uint32_t)err);
-
-    vTaskDelay(5);
-    err = mbc_master_set_descriptor(&device_parameters[0], num_device_parameters);
-    MASTER_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                                "mb controller set descriptor fail, returns(0x%x).",
-                                (uint32_t)err);
-    ESP_LOGI(TAG, "Modbus master stack initialized...");
-    return err;
+    if(s_shadow_mutex == NULL || s_poll_done == NULL)
+        return ESP_ERR_INVALID_STATE;
+    for(int i=0; i<MB_SCAN_MAX_ENTRIES; i++) {
+        if(s_shadow[i].pdu == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+
+    s_poll_task = xTaskGetCurrentTaskHandle();
+
+    ESP_LOGI(TAG, "Modbus master poller initialized...");
+    return ESP_OK;
 }
 
 void mbRtuMasterTask(void *pvParameters) {
@@ -325,9 +876,13 @@ void mbRtuMasterTask(void *pvParameters) {
     num_device_parameters = (sizeof(device_parameters)/sizeof(device_parameters[0]));
 
 	ESP_ERROR_CHECK(master_init());
+#if CONFIG_MB_GATEWAY_POLL_CIDS
+    master_build_blocks();
+#endif
 
     vTaskDelay(10);
 
     master_operation_func(NULL);
-}
 
+    vTaskDelete(NULL);
+}
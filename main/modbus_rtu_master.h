@@ -6,9 +6,48 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdbool.h>
 
+#include "esp_err.h"
+
+#define MB_SCAN_MAX_ENTRIES 32
+
+typedef struct {
+    uint8_t uid;
+    uint8_t function; /* 1 to 4 */
+    uint16_t start;
+    uint16_t count; /* Registers, or coils / inputs */
+    uint32_t interval_ms; /* Poll period, 0 when the entry is unused */
+} mb_scan_entry_t;
+
+typedef struct {
+    uint32_t polls;
+    uint32_t errors;
+    uint32_t late; /* Polls that missed their deadline by a whole period */
+    uint32_t hits; /* Gateway reads answered from the shadow map */
+} mb_scan_stats_t;
+
+void initialize_modbus_rtu_master();
 void mbRtuMasterTask(void *pvParameters);
 
+esp_err_t mb_scan_set_entry(int index, const mb_scan_entry_t *entry); /* interval_ms 0 deletes */
+const mb_scan_entry_t *mb_scan_get_entry(int index); /* NULL if unused */
+uint32_t mb_scan_get_period(int index); /* Current period, longer than interval_ms while the range is stable */
+
+/* Share of the bus time the poller may take, in percent */
+esp_err_t mb_scan_set_budget(uint8_t percent);
+uint8_t mb_scan_get_budget();
+
+/* Answers a read from the shadow map when the range lies in a fresh scan entry */
+bool mb_scan_lookup(uint8_t uid, const uint8_t *req, uint16_t req_len, uint8_t *rsp, uint16_t *rsp_len);
+void mb_scan_invalidate(uint8_t uid, const uint8_t *req, uint16_t req_len);
+void mb_scan_invalidate_unit(uint8_t uid); /* Every range of uid, its route changed */
+
+void mb_scan_get_stats(mb_scan_stats_t *stats);
+
+void mb_scan_load_config();
+void mb_scan_save_config();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "sdkconfig.h"
+
+#include "modbus_serial.h"
+
+static const char *TAG = "mb_serial";
+
+//
+// Modbus serial line transport : the gateway hands over a PDU as received
+// in the MBAP frame, it goes out with address and CRC (RTU) or LRC (ASCII)
+// and the slave's PDU comes back untouched, whatever the function code.
+//
+#define MB_SERIAL_PDU_SIZE_MAX 253
+#define MB_RTU_FRAME_SIZE_MAX (1 + MB_SERIAL_PDU_SIZE_MAX + 2) // Address, PDU, CRC
+#define MB_ASCII_FRAME_SIZE_MAX (1 + (1 + MB_SERIAL_PDU_SIZE_MAX + 1) * 2 + 2) // ':', hex, CR LF
+
+#define MB_ASCII_CHAR_TIMEOUT_MS 1000 // Inter character timeout of the ASCII mode
+#define MB_BROADCAST_TURNAROUND_MS 100 // Time left to slaves to process a broadcast
+
+#define UART_BUF_SIZE (MB_ASCII_FRAME_SIZE_MAX * 2)
+
+//
+// The driver hands received bytes over once the RX FIFO holds
+// MB_SERIAL_RXFIFO_FULL of them, or after MB_SERIAL_RX_TOUT idle characters.
+// The defaults (120 bytes, 10 characters) would deliver a whole answer only
+// once it ended and blur the first byte time with the answer length.
+//
+// Median time to a complete FC3 answer of 10 registers (1 ms turnaround),
+// against a pty slave pacing bytes at the baudrate behind a model of the
+// driver's delivery, 200 transactions each, in ms :
+//
+//   baud    on wire   t3.5 silence  length 10/120  length 3/8
+//   9600     29.6       44.2          40.2           32.1
+//   19200    15.3       22.7          20.6           16.6
+//   38400     8.2       12.7          10.9            8.8
+//   115200    3.4        6.1           4.3            3.6
+//
+#define MB_SERIAL_RX_TOUT 3 // Characters, as esp-modbus
+#define MB_SERIAL_RXFIFO_FULL 8
+
+typedef struct {
+    mb_serial_mode_t mode;
+    mb_serial_line_t line;
+    TickType_t t35; // End of frame silence, in ticks
+    TickType_t gap; // Longest wait between two chunks from the driver, at least t35
+    uint32_t char_us; // Time on the wire of one character
+    mb_serial_stats_t stats;
+} mb_serial_port_t;
+
+static mb_serial_port_t s_ports[UART_NUM_MAX];
+
+#define SERIAL_CHECK(a, ret_val, str, ...) \
+    if (!(a)) { \
+        ESP_LOGE(TAG, "%s(%u): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+        return (ret_val); \
+    }
+
+static uint16_t _crc16(const uint8_t *buf, uint16_t len)
+{
+    uint16_t crc = 0xffff;
+
+    while(len--) {
+        crc ^= *buf++;
+        for(int i=0; i<8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+uint16_t mb_serial_crc16(const uint8_t *buf, uint16_t len)
+{
+    return _crc16(buf, len);
+}
+
+static uint8_t _lrc(const uint8_t *buf, uint16_t len)
+{
+    uint8_t lrc = 0;
+
+    while(len--)
+        lrc += *buf++;
+
+    return (uint8_t)(-lrc);
+}
+
+static inline char _hex_char(uint8_t v)
+{
+    return v < 10 ? '0' + v : 'A' + v - 10;
+}
+
+static inline int _hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Modbus over serial line 2.3.2 : 3.5 characters, 1.75 ms fixed above 19200 bps */
+static TickType_t _t35_ticks(int baudrate)
+{
+    uint32_t us = (baudrate > 19200) ? 1750 : 3500 * 11 * 1000 / baudrate;
+    TickType_t ticks = pdMS_TO_TICKS((us + 999) / 1000);
+
+    return ticks + 1; // A tick boundary may fall just after the last byte
+}
+
+static void _set_timing(mb_serial_port_t *p, const mb_serial_line_t *line)
+{
+    /* Start, 8 data, parity, stop bits */
+    int bits = 1 + 8 + (line->parity != UART_PARITY_DISABLE ? 1 : 0) + (line->stop_bits == UART_STOP_BITS_1 ? 1 : 2);
+
+    p->line = *line;
+    p->t35 = _t35_ticks(line->baudrate);
+    p->char_us = bits * 1000000 / line->baudrate;
+
+    /* A chunk comes every MB_SERIAL_RXFIFO_FULL characters, the last one MB_SERIAL_RX_TOUT after the frame */
+    TickType_t chunk = pdMS_TO_TICKS(((MB_SERIAL_RXFIFO_FULL + MB_SERIAL_RX_TOUT) * p->char_us + 999) / 1000) + 1;
+    p->gap = (chunk > p->t35) ? chunk : p->t35;
+}
+
+esp_err_t mb_serial_init(uart_port_t port, const mb_serial_config_t *config)
+{
+    SERIAL_CHECK((port >= 0 && port < UART_NUM_MAX), ESP_ERR_INVALID_ARG, "invalid uart port %d", port);
+
+    uart_config_t uart_config = {
+        .baud_rate = config->line.baudrate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = config->line.parity,
+        .stop_bits = config->line.stop_bits,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = 0,
+        .source_clk = UART_SCLK_APB,
+    };
+
+    esp_err_t err = uart_param_config(port, &uart_config);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_param_config() returned (0x%x).", (uint32_t)err);
+    err = uart_driver_install(port, UART_BUF_SIZE, UART_BUF_SIZE, 0, NULL, 0);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_driver_install() returned (0x%x).", (uint32_t)err);
+    // Set UART pin numbers
+    err = uart_set_pin(port, config->txd, config->rxd, config->rts, UART_PIN_NO_CHANGE);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_pin() returned (0x%x).", (uint32_t)err);
+    // Set driver mode to Half Duplex
+    err = uart_set_mode(port, UART_MODE_RS485_HALF_DUPLEX);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_mode() returned (0x%x).", (uint32_t)err);
+    err = uart_set_rx_timeout(port, MB_SERIAL_RX_TOUT);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_rx_timeout() returned (0x%x).", (uint32_t)err);
+    err = uart_set_rxfifo_full_threshold(port, MB_SERIAL_RXFIFO_FULL);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_rxfifo_full_threshold() returned (0x%x).", (uint32_t)err);
+
+    s_ports[port].mode = config->mode;
+    _set_timing(&s_ports[port], &config->line);
+    memset(&s_ports[port].stats, 0, sizeof(mb_serial_stats_t));
+
+    return ESP_OK;
+}
+
+esp_err_t mb_serial_set_line(uart_port_t port, const mb_serial_line_t *line)
+{
+    SERIAL_CHECK((port >= 0 && port < UART_NUM_MAX), ESP_ERR_INVALID_ARG, "invalid uart port %d", port);
+    SERIAL_CHECK((line->baudrate >= 1200 && line->baudrate <= 921600), ESP_ERR_INVALID_ARG, "invalid baudrate %d", line->baudrate);
+
+    uart_wait_tx_done(port, portMAX_DELAY);
+
+    esp_err_t err = uart_set_baudrate(port, line->baudrate);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_baudrate() returned (0x%x).", (uint32_t)err);
+    err = uart_set_parity(port, line->parity);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_parity() returned (0x%x).", (uint32_t)err);
+    err = uart_set_stop_bits(port, line->stop_bits);
+    SERIAL_CHECK((err == ESP_OK), err, "uart_set_stop_bits() returned (0x%x).", (uint32_t)err);
+
+    uart_flush_input(port);
+    _set_timing(&s_ports[port], line);
+
+    return ESP_OK;
+}
+
+void mb_serial_get_line(uart_port_t port, mb_serial_line_t *line)
+{
+    if(port >= 0 && port < UART_NUM_MAX)
+        *line = s_ports[port].line;
+}
+
+/*
+ * RTU answer length as far as the bytes received tell, 0 while unknown.
+ * Reads and read / write announce a byte count, writes echo a fixed size,
+ * anything else can only end on silence.
+ */
+static int _rtu_expected_len(const uint8_t *buf, int n, uint8_t function)
+{
+    if(n < 2)
+        return 0;
+
+    if(buf[1] & 0x80)
+        return 5; // Address, function, exception code, CRC
+
+    switch(function) {
+        case 1: /* Read coils */
+        case 2: /* Read discrete inputs */
+        case 3: /* Read holding registers */
+        case 4: /* Read input registers */
+        case 23: /* Read / write multiple registers */
+            return (n >= 3) ? 3 + buf[2] + 2 : 0;
+        case 5: /* Write single coil */
+        case 6: /* Write single register */
+        case 15: /* Write multiple coils */
+        case 16: /* Write multiple registers */
+            return 8;
+        case 22: /* Mask write register */
+            return 10;
+        default:
+            return 0;
+    }
+}
+
+static inline TickType_t _bytes_ticks(const mb_serial_port_t *p, int bytes)
+{
+    return pdMS_TO_TICKS((bytes * p->char_us + 999) / 1000);
+}
+
+/* Time since the first byte of the chunk the driver just delivered went out of the slave */
+static uint32_t _chunk_age_us(uart_port_t port, const mb_serial_port_t *p)
+{
+    size_t buffered = 0;
+    uart_get_buffered_data_len(port, &buffered);
+
+    return (1 + buffered) * p->char_us;
+}
+
+/*
+ * Reads an RTU frame and returns its length. The frame ends as soon as its
+ * expected length is in, else when the line stays silent for t3.5 (or the
+ * driver's chunk delay when longer).
+ */
+static int _read_rtu(uart_port_t port, uint8_t *buf, int size, uint8_t function, TickType_t first, uint32_t *turnaround_us)
+{
+    mb_serial_port_t *p = &s_ports[port];
+    int64_t t0 = esp_timer_get_time();
+    int n = uart_read_bytes(port, buf, 1, first);
+    if(n <= 0)
+        return 0;
+    if(turnaround_us) {
+        uint32_t elapsed = esp_timer_get_time() - t0;
+        uint32_t age = _chunk_age_us(port, p);
+        *turnaround_us = (elapsed > age) ? elapsed - age : 0;
+    }
+
+    int expected = 0;
+    while(n < size) {
+        if(expected == 0)
+            expected = _rtu_expected_len(buf, n, function);
+        if(expected > size)
+            expected = size;
+        if(expected && n >= expected)
+            break;
+
+        int r;
+        if(expected) /* The rest is on its way, allow its time on the wire plus one gap */
+            r = uart_read_bytes(port, buf + n, expected - n, _bytes_ticks(p, expected - n) + p->gap);
+        else
+            r = uart_read_bytes(port, buf + n, (n < 3) ? 3 - n : size - n, p->gap);
+        if(r <= 0)
+            break;
+        n += r;
+    }
+
+    if(expected && n == expected)
+        p->stats.by_length++;
+    else
+        p->stats.by_silence++;
+
+    return n;
+}
+
+/* Reads from ':' up to LF, returns the frame length */
+static int _read_ascii(uart_port_t port, uint8_t *buf, int size, TickType_t first, uint32_t *turnaround_us)
+{
+    int n = 0;
+    TickType_t wait = first;
+    int64_t t0 = esp_timer_get_time();
+
+    while(n < size) {
+        if(uart_read_bytes(port, &buf[n], 1, wait) <= 0)
+            return 0;
+        if(t0 && turnaround_us)
+            *turnaround_us = esp_timer_get_time() - t0;
+        t0 = 0;
+        wait = pdMS_TO_TICKS(MB_ASCII_CHAR_TIMEOUT_MS);
+        if(n == 0 && buf[0] != ':')
+            continue; /* Noise before start of frame */
+        if(buf[n++] == '\n')
+            return n;
+    }
+
+    return 0;
+}
+
+static esp_err_t _transact_rtu(uart_port_t port, uint8_t uid, const uint8_t *req, uint16_t req_len,
+                               uint8_t *rsp, uint16_t *rsp_len, uint32_t timeout_ms, uint32_t *turnaround_us)
+{
+    uint8_t frame[MB_RTU_FRAME_SIZE_MAX];
+
+    frame[0] = uid;
+    memcpy(&frame[1], req, req_len);
+    uint16_t crc = _crc16(frame, 1 + req_len);
+    frame[1 + req_len] = crc & 0xff;
+    frame[2 + req_len] = crc >> 8;
+
+    uart_flush_input(port);
+    uart_write_bytes(port, frame, 3 + req_len);
+    uart_wait_tx_done(port, pdMS_TO_TICKS(timeout_ms));
+
+    if(uid == 0) {
+        vTaskDelay(pdMS_TO_TICKS(MB_BROADCAST_TURNAROUND_MS));
+        *rsp_len = 0;
+        return ESP_OK;
+    }
+
+    int n = _read_rtu(port, frame, sizeof(frame), req[0], pdMS_TO_TICKS(timeout_ms), turnaround_us);
+    if(n == 0)
+        return ESP_ERR_TIMEOUT;
+    if(n < 4 || _crc16(frame, n) != 0) /* CRC over a frame including its CRC is 0 */
+        return ESP_ERR_INVALID_CRC;
+    if(frame[0] != uid || (frame[1] & 0x7f) != req[0])
+        return ESP_ERR_INVALID_RESPONSE;
+
+    *rsp_len = n - 3;
+    memcpy(rsp, &frame[1], *rsp_len);
+
+    return ESP_OK;
+}
+
+static esp_err_t _transact_ascii(uart_port_t port, uint8_t uid, const uint8_t *req, uint16_t req_len,
+                                 uint8_t *rsp, uint16_t *rsp_len, uint32_t timeout_ms, uint32_t *turnaround_us)
+{
+    uint8_t bin[1 + MB_SERIAL_PDU_SIZE_MAX + 1];
+    uint8_t frame[MB_ASCII_FRAME_SIZE_MAX];
+
+    bin[0] = uid;
+    memcpy(&bin[1], req, req_len);
+    bin[1 + req_len] = _lrc(bin, 1 + req_len);
+
+    int n = 0;
+    frame[n++] = ':';
+    for(int i=0; i<2 + req_len; i++) {
+        frame[n++] = _hex_char(bin[i] >> 4);
+        frame[n++] = _hex_char(bin[i] & 0x0f);
+    }
+    frame[n++] = '\r';
+    frame[n++] = '\n';
+
+    uart_flush_input(port);
+    uart_write_bytes(port, frame, n);
+    uart_wait_tx_done(port, pdMS_TO_TICKS(timeout_ms));
+
+    if(uid == 0) {
+        vTaskDelay(pdMS_TO_TICKS(MB_BROADCAST_TURNAROUND_MS));
+        *rsp_len = 0;
+        return ESP_OK;
+    }
+
+    n = _read_ascii(port, frame, sizeof(frame), pdMS_TO_TICKS(timeout_ms), turnaround_us);
+    if(n == 0)
+        return ESP_ERR_TIMEOUT;
+    s_ports[port].stats.by_length++; /* LF ends every ASCII frame */
+    if(n < 1 + 6 + 2 || (n - 3) % 2 != 0 || frame[n - 2] != '\r')
+        return ESP_ERR_INVALID_CRC;
+
+    int len = (n - 3) / 2;
+    for(int i=0; i<len; i++) {
+        int hi = _hex_value(frame[1 + i * 2]);
+        int lo = _hex_value(frame[2 + i * 2]);
+        if(hi < 0 || lo < 0)
+            return ESP_ERR_INVALID_CRC;
+        bin[i] = (hi << 4) | lo;
+    }
+
+    if(_lrc(bin, len) != 0) /* Sum including the LRC byte is 0 */
+        return ESP_ERR_INVALID_CRC;
+    if(bin[0] != uid || (bin[1] & 0x7f) != req[0])
+        return ESP_ERR_INVALID_RESPONSE;
+
+    *rsp_len = len - 2;
+    memcpy(rsp, &bin[1], *rsp_len);
+
+    return ESP_OK;
+}
+
+esp_err_t mb_serial_transact(uart_port_t port, uint8_t uid, const uint8_t *req, uint16_t req_len,
+                             uint8_t *rsp, uint16_t *rsp_len, uint32_t timeout_ms, uint32_t *turnaround_us)
+{
+    if(port < 0 || port >= UART_NUM_MAX || req_len < 1 || req_len > MB_SERIAL_PDU_SIZE_MAX)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err;
+    if(s_ports[port].mode == MB_SERIAL_MODE_ASCII)
+        err = _transact_ascii(port, uid, req, req_len, rsp, rsp_len, timeout_ms, turnaround_us);
+    else
+        err = _transact_rtu(port, uid, req, req_len, rsp, rsp_len, timeout_ms, turnaround_us);
+
+    if(err == ESP_ERR_TIMEOUT)
+        s_ports[port].stats.timeouts++;
+    else if(err == ESP_ERR_INVALID_CRC)
+        s_ports[port].stats.crc_errors++;
+
+    return err;
+}
+
+void mb_serial_get_stats(uart_port_t port, mb_serial_stats_t *stats)
+{
+    if(port >= 0 && port < UART_NUM_MAX)
+        memcpy(stats, &s_ports[port].stats, sizeof(mb_serial_stats_t));
+}
@@ -0,0 +1,66 @@
+#ifndef _MODBUS_SERIAL_H
+#define _MODBUS_SERIAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "driver/uart.h"
+
+typedef enum {
+    MB_SERIAL_MODE_RTU = 0,
+    MB_SERIAL_MODE_ASCII
+} mb_serial_mode_t;
+
+typedef struct {
+    int baudrate;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+} mb_serial_line_t;
+
+typedef struct {
+    mb_serial_mode_t mode;
+    mb_serial_line_t line;
+    int txd;
+    int rxd;
+    int rts; /* Drives ~RE/DE of the RS485 transceiver */
+} mb_serial_config_t;
+
+typedef struct {
+    uint32_t by_length; /* Answers completed on their expected length */
+    uint32_t by_silence; /* Answers completed on the t3.5 silence */
+    uint32_t timeouts;
+    uint32_t crc_errors;
+} mb_serial_stats_t;
+
+esp_err_t mb_serial_init(uart_port_t port, const mb_serial_config_t *config);
+/* Not while a transaction is running on the port */
+esp_err_t mb_serial_set_line(uart_port_t port, const mb_serial_line_t *line);
+void mb_serial_get_line(uart_port_t port, mb_serial_line_t *line);
+
+/*
+ * Sends the request PDU to unit uid and waits for the answer, rsp receives the
+ * slave's PDU verbatim (MB_PDU_SIZE_MAX bytes, may be req). A broadcast (uid 0) is not
+ * answered, *rsp_len is 0 once the turnaround delay has elapsed.
+ * timeout_ms bounds the wait for the first byte of the answer, *turnaround_us
+ * (may be NULL) receives the time from end of request to that first byte.
+ * Returns ESP_ERR_TIMEOUT when the slave is silent, ESP_ERR_INVALID_CRC on a
+ * corrupted frame and ESP_ERR_INVALID_RESPONSE when another unit answered.
+ */
+esp_err_t mb_serial_transact(uart_port_t port, uint8_t uid, const uint8_t *req, uint16_t req_len,
+                             uint8_t *rsp, uint16_t *rsp_len, uint32_t timeout_ms, uint32_t *turnaround_us);
+
+void mb_serial_get_stats(uart_port_t port, mb_serial_stats_t *stats);
+
+/* Modbus RTU CRC, 0 over a frame that ends with its own CRC */
+uint16_t mb_serial_crc16(const uint8_t *buf, uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
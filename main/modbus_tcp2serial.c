@@ -1,30 +1,32 @@
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "soc/soc_memory_layout.h"
 #include "esp_netif.h"
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_event.h"
+#include "esp_attr.h"
+#include "nvs_flash.h"
 #include "lwip/sockets.h"
 
 #include "sdkconfig.h"
 
 #include "esp32_malloc.h"
-#include "esp_modbus_master.h"
-
-#define MB_PORT_NUM     (CONFIG_MB_UART_PORT_NUM)   // Number of UART port used for Modbus connection
-#define MB_DEV_SPEED    (CONFIG_MB_UART_BAUD_RATE)  // The communication speed of the UART
+#include "http_server.h"
+#include "modbus_bus.h"
+#include "modbus_local.h"
+#include "modbus_serial.h"
+#include "modbus_tcp2serial.h"
 
 #define MB_TCP_PORT_NUMBER      (CONFIG_FMB_TCP_PORT_DEFAULT)
 
 static const char *TAG = "tcp2serial";
 
-#define SENSE_MB_CHECK(a, ret_val, str, ...) \
-    if (!(a)) { \
-        ESP_LOGE(TAG, "%s(%u): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
-        return (ret_val); \
-    }
-
 //
 // MODBUS MBAP offsets
 //
@@ -33,305 +35,1264 @@ static const char *TAG = "tcp2serial";
 #define MB_TCP_LEN 4
 #define MB_TCP_UID 6
 #define MB_TCP_FUNC 7
-#define MB_TCP_REGISTER_START 8
-#define MB_TCP_REGISTER_NUMBER 10
-
-//static uint8_t s_tcp_tx_buf[128];
-//static uint8_t s_tcp_rx_buf[128];
-
-// Function code
-#define MB_FUNC_READ_COILS 1
-#define MB_FUNC_READ_DISCRETE_INPUTS 2
-#define MB_FUNC_READ_HOLDING_REGISTERS 3
-#define MB_FUNC_READ_INPUT_REGISTER 4
-
-#define MB_FUNC_WRITE_SINGLE_COIL 5
-#define MB_FUNC_WRITE_SINGLE_REGISTER 6
-#define MB_FUNC_READ_EXCEPTION_STATUS 7
-#define MB_FUNC_DIAGNOSTIC 8
-
-esp_err_t modbus_serial_master_init(uart_port_t port, int baudrate, uart_parity_t parity)
-{
-    mb_communication_info_t comm = {
-            .port = port,
-#if CONFIG_MB_COMM_MODE_RTU            
-            .mode = MB_MODE_RTU,
-#elif CONFIG_MB_COMM_MODE_ASCII
-            .mode = MB_MODE_ASCII,
-#endif
-            .baudrate = baudrate,
-            .parity = parity
-    };
-    void* master_handler = NULL;
-
-    esp_err_t err = mbc_master_init(MB_PORT_SERIAL_MASTER, &master_handler);
-    SENSE_MB_CHECK((master_handler != NULL), ESP_ERR_INVALID_STATE,
-                                "mb controller initialization fail.");
-    SENSE_MB_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                            "mb controller initialization fail, returns(0x%x).",
-                            (uint32_t)err);
-    err = mbc_master_setup((void*)&comm);
-    SENSE_MB_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                            "mb controller setup fail, returns(0x%x).",
-                            (uint32_t)err);
-    err = mbc_master_start();
-    SENSE_MB_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-                            "mb controller start fail, returns(0x%x).",
-                            (uint32_t)err);
-    // Set UART pin numbers
-    err = uart_set_pin(port, CONFIG_MB_UART_TXD, CONFIG_MB_UART_RXD,
-                                    CONFIG_MB_UART_RTS, UART_PIN_NO_CHANGE);
-    SENSE_MB_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-            "mb serial set pin failure, uart_set_pin() returned (0x%x).", (uint32_t)err); 
-    // Set driver mode to Half Duplex
-    err = uart_set_mode(port, UART_MODE_RS485_HALF_DUPLEX);
-    SENSE_MB_CHECK((err == ESP_OK), ESP_ERR_INVALID_STATE,
-            "mb serial set mode failure, uart_set_mode() returned (0x%x).", (uint32_t)err);
-    vTaskDelay(5);
-
-    return err;
-}
-
-static uint16_t s_tcp_port = 503;
+
+static uint16_t s_tcp_port = 502;
 
 static void modbus_tcp_slave_init(uint16_t port)
 {
 	s_tcp_port = port;
 }
 
-static xSemaphoreHandle mbc_mutex;
+#define MAX_TCP_CONNECTIONS (CONFIG_MB_GATEWAY_MAX_CONNECTIONS)
+static size_t s_num_tcp_connections = 0;
 
-void initialize_modbus_tcp2serial()
+//
+// Dead client reaping : TCP keepalive finds peers that vanished, the idle
+// timeout closes clients that stay connected without asking anything. With
+// every slot taken a new client evicts the least recently active connection
+// that has nothing in flight, rather than being refused. An accept() failing
+// for want of sockets evicts instead, lwIP has reset that client already but
+// its next attempt gets through. Either way one client at most per accept.
+//
+#define TCP_KEEPALIVE_INTERVAL_S 5
+#define TCP_KEEPALIVE_COUNT 3
+
+//
+// Pipelining : every complete MBAP frame received on a connection is queued
+// to the bus task immediately, the connection keeps reading while earlier
+// transactions are still on the wire. Responses are sent as they finish.
+//
+#define MAX_PIPELINE_DEPTH (CONFIG_MB_GATEWAY_PIPELINE_DEPTH) // Outstanding transactions per connection
+
+//
+// Pools : connections and request frames are allocated once at boot, in
+// internal RAM or PSRAM as configured, and recycled from there. Frames are
+// shared by all connections, a connection holds at most MAX_PIPELINE_DEPTH
+// of them. Nothing is allocated when a client connects or sends a request.
+//
+#define TCP_FRAME_POOL_SIZE (CONFIG_MB_GATEWAY_FRAME_POOL)
+
+#if CONFIG_MB_GATEWAY_POOL_INTERNAL
+#define TCP_POOL_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#else
+#define TCP_POOL_CAPS (MALLOC_CAP_SPIRAM)
+#endif
+
+#define MB_TCP_MBAP_SIZE 7 // TID + PID + LEN + UID
+
+#define TCP_TX_BUF_SIZE (MB_TCP_MBAP_SIZE + MB_PDU_SIZE_MAX)
+
+//
+// Output queue : sockets are nonblocking, a response goes into the
+// connection's output queue and is sent from there. The bus task sends at
+// once when nothing is waiting, otherwise the event loop sends everything
+// queued in one segment when the socket takes data again. A client that
+// overflows its queue, or leaves it stuck for CONFIG_MB_GATEWAY_SEND_TIMEOUT_MS,
+// is a slow consumer and gets disconnected.
+//
+#define TCP_TX_QUEUE_SIZE (CONFIG_MB_GATEWAY_TX_QUEUE)
+
+//
+// Other framings, same bus queue and frame pool :
+// - RTU over TCP, unit ID + PDU + CRC as on the wire. Without a transaction
+//   ID answers must come back in order, so one request at a time per client.
+//   The frame length comes from the function code.
+// - Modbus/UDP, one MBAP frame per datagram. The answer goes back to the
+//   sender with the same transaction ID, a retransmit of a request still in
+//   progress is dropped instead of queued twice. All UDP masters are one
+//   bus client.
+//
+#define RTU_TCP_PORT_NUMBER (CONFIG_MB_GATEWAY_RTU_TCP_PORT) // 0 disables
+#define UDP_PORT_NUMBER (CONFIG_MB_GATEWAY_UDP_PORT) // 0 disables
+
+#define RTU_FRAME_SIZE_MAX (MB_PDU_SIZE_MAX + 3) // Unit ID + PDU + CRC
+
+//
+// Socket budget : every connection slot must be backed by a free lwIP socket
+// and a free TCP PCB, else accept() fails and the client is reset before the
+// table is ever full. lwIP takes at most 16 sockets.
+//
+#define TCP_LISTEN_SOCKETS (1 + (RTU_TCP_PORT_NUMBER > 0) + (UDP_PORT_NUMBER > 0))
+#define TCP_OTHER_SOCKETS (HTTP_SERVER_MAX_CLIENTS + 2 + 2 + 1 + 1) // httpd clients, listen and control, telnetd, ping, OTA
+#define TCP_OTHER_ACTIVE_TCP (HTTP_SERVER_MAX_CLIENTS + 1 + 1) // httpd clients, telnetd client, OTA
+
+#if MAX_TCP_CONNECTIONS + TCP_LISTEN_SOCKETS + TCP_OTHER_SOCKETS > CONFIG_LWIP_MAX_SOCKETS
+#error "CONFIG_LWIP_MAX_SOCKETS too small for CONFIG_MB_GATEWAY_MAX_CONNECTIONS"
+#endif
+#if MAX_TCP_CONNECTIONS + TCP_OTHER_ACTIVE_TCP > CONFIG_LWIP_MAX_ACTIVE_TCP
+#error "CONFIG_LWIP_MAX_ACTIVE_TCP too small for CONFIG_MB_GATEWAY_MAX_CONNECTIONS"
+#endif
+
+//
+// MBAP stream reassembly : recv() writes straight into a per connection ring,
+// frames are cut out by the MBAP length field. A frame may arrive split over
+// several segments or share a segment with others, nothing is compacted.
+//
+#define TCP_RX_RING_SIZE 1024 // Must be power of 2, at least 2 maximum frames
+#define TCP_RX_RING_MASK (TCP_RX_RING_SIZE - 1)
+
+typedef struct {
+    uint32_t head; // Free running write index
+    uint32_t tail; // Free running read index
+    uint8_t buf[TCP_RX_RING_SIZE];
+} mbap_ring_t;
+
+static inline size_t _ring_used(const mbap_ring_t *r)
 {
-    mbc_mutex = xSemaphoreCreateMutex();
+    return r->head - r->tail;
+}
 
-    modbus_serial_master_init(MB_PORT_NUM, MB_DEV_SPEED, UART_PARITY_EVEN);
-	modbus_tcp_slave_init(MB_TCP_PORT_NUMBER + 1);
+static inline uint8_t _ring_peek(const mbap_ring_t *r, size_t off)
+{
+    return r->buf[(r->tail + off) & TCP_RX_RING_MASK];
 }
 
-#define MAX_TCP_CONNECTIONS 8
-static size_t s_num_tcp_connections = 0;
+static inline uint16_t _ring_peek16(const mbap_ring_t *r, size_t off)
+{
+    return (_ring_peek(r, off) << 8) + _ring_peek(r, off + 1);
+}
+
+/* Contiguous free space at head, recv() target */
+static size_t _ring_write_span(mbap_ring_t *r, uint8_t **p)
+{
+    size_t idx = r->head & TCP_RX_RING_MASK;
+    size_t span = TCP_RX_RING_SIZE - idx;
+    size_t avail = TCP_RX_RING_SIZE - _ring_used(r);
+
+    *p = &r->buf[idx];
+    return span < avail ? span : avail;
+}
+
+/* Copy len bytes at off from tail, handles wrap around */
+static void _ring_copy(const mbap_ring_t *r, size_t off, uint8_t *dst, size_t len)
+{
+    size_t idx = (r->tail + off) & TCP_RX_RING_MASK;
+    size_t first = TCP_RX_RING_SIZE - idx;
+
+    if(first >= len) {
+        memcpy(dst, &r->buf[idx], len);
+    } else {
+        memcpy(dst, &r->buf[idx], first);
+        memcpy(dst + first, &r->buf[0], len - first);
+    }
+}
+
+//
+// Rate limiting : token buckets per connection and per source address, in
+// requests and in estimated bus time, both refilled every second and able to
+// hold one second worth of tokens. A request over the limit stays in the ring
+// (delay, TCP pushes back on the client) or is answered 0x06 at once (reject).
+//
+#define MB_EX_SLAVE_DEVICE_BUSY 0x06
+
+typedef struct {
+    int32_t requests; // In 1/1000 request
+    int32_t bus_us;
+    uint32_t tick; // Last refill
+} tcp_bucket_t;
 
 typedef struct {
+    char addr_str[32];
+    uint16_t conns; // Connections from this address, 0 when the entry is free
+    bool udp; // Datagrams came from this address, the entry is kept with no connection
+    uint32_t udp_tick; // Last datagram, the oldest UDP only entry is recycled
+    tcp_bucket_t bucket;
+    uint32_t throttled;
+} tcp_peer_t;
+
+//
+// Modbus/UDP senders are charged to the same address buckets as the TCP
+// connections, UDP only addresses take the entries connections do not use.
+//
+#define TCP_UDP_PEERS 8
+
+static mb_tcp_limits_t s_limits = { 0 };
+static xSemaphoreHandle s_limits_mutex; // Set from the console while the event loop reads them
+static tcp_peer_t s_tcp_peers[MAX_TCP_CONNECTIONS + TCP_UDP_PEERS];
+
+typedef struct tcp_conn tcp_conn_t;
+
+typedef enum {
+    TCP_PROTO_MBAP = 0,
+    TCP_PROTO_RTU,
+    TCP_PROTO_UDP,
+} tcp_proto_t;
+
+typedef struct {
+    mb_bus_txn_t bus; // Must be first, the bus hands it back to _tcp_txn_done()
+    tcp_conn_t *conn; // NULL for UDP
+    uint8_t proto;
+    bool busy; // Queued or on the bus
+    uint16_t tid;
+    struct sockaddr_in from; // UDP sender
+    uint8_t mbap[MB_TCP_MBAP_SIZE]; // UDP answer header, sent ahead of bus.pdu
+} mb_txn_t;
+
+typedef enum {
+    TCP_CONN_FREE = 0,
+    TCP_CONN_OPEN,
+    TCP_CONN_CLOSING, // No more reads, waiting for transactions in flight
+} tcp_conn_state_t;
+
+struct tcp_conn {
+    tcp_conn_state_t state;
+    uint8_t proto;
     int sock;
     char addr_str[32];
-} tcp_task_t;
+    xSemaphoreHandle credits; // Frames this connection may still take, bus task gives them back
+    mb_bus_client_t client;
+    uint32_t last_tick; // Last data received
+    tcp_peer_t *peer;
+    tcp_bucket_t bucket;
+    uint32_t requests;
+    uint32_t throttled;
+    bool held; // The frame at the head of the ring waits for the bucket, already counted as throttled
+    mbap_ring_t rx;
+    xSemaphoreHandle tx_lock; // Output queue is filled by the bus task, drained by both
+    bool tx_error; // Send failed or slow consumer, output is dropped
+    uint32_t tx_tick; // Last progress of the output queue
+    size_t tx_len;
+    uint8_t tx[TCP_TX_QUEUE_SIZE];
+};
+
+//
+// All connections are served by the single mbTcp2Serial_task event loop,
+// connection state comes from this pool instead of a task stack per client.
+//
+static tcp_conn_t *s_tcp_conns = NULL;
+static size_t s_tcp_conns_peak = 0;
+
+static mb_txn_t *s_tcp_frames = NULL;
+static xQueueHandle s_free_frames = NULL; // Idle frames, bus task gives them back
+static size_t s_tcp_frames_peak = 0;
+static uint32_t s_tcp_frame_waits = 0;
+static bool s_tcp_pool_psram = false;
+
+static uint32_t s_tcp_slow_drops = 0;
+
+static int s_udp_sock = -1;
+static mb_bus_client_t s_udp_client;
+static xSemaphoreHandle s_udp_credits = NULL;
+static mb_udp_stats_t s_udp_stats = { 0 };
+
+/* Request being cut out of a stream or a datagram, only used by the event loop */
+static uint8_t s_rx_frame[RTU_FRAME_SIZE_MAX > TCP_TX_BUF_SIZE ? RTU_FRAME_SIZE_MAX : TCP_TX_BUF_SIZE];
 
-static void _tcp_task(void *pvParameters)
+/* Pipeline slot and frame, NULL if either is exhausted */
+static mb_txn_t *_tcp_frame_take(xSemaphoreHandle credits)
 {
-    tcp_task_t *p = (tcp_task_t *)pvParameters;
-    int sock = p->sock;
-    char addr_str[32];
-    snprintf(addr_str, sizeof(addr_str), "%s", p->addr_str);
+    if(xSemaphoreTake(credits, 0) != pdTRUE) /* Pipeline is full */
+        return NULL;
+
+    mb_txn_t *t;
+    if(xQueueReceive(s_free_frames, &t, 0) != pdTRUE) { /* Pool is empty, other connections hold every frame */
+        xSemaphoreGive(credits);
+        s_tcp_frame_waits++;
+        return NULL;
+    }
 
-#define TCP_TX_BUF_SIZE 256
-#define TCP_RX_BUF_SIZE 256
+    size_t used = TCP_FRAME_POOL_SIZE - uxQueueMessagesWaiting(s_free_frames);
+    if(used > s_tcp_frames_peak)
+        s_tcp_frames_peak = used;
 
-    uint8_t tcp_tx_buf[TCP_TX_BUF_SIZE];
-    uint8_t tcp_rx_buf[TCP_RX_BUF_SIZE];
+    t->busy = true;
+    t->bus.flags = 0;
 
-    while (1) {
-        int len = recv(sock, tcp_rx_buf, TCP_RX_BUF_SIZE - 1, 0);            
-        if(len < 0) { // Error occurred during receiving
-            ESP_LOGE(TAG, "recv failed: errno %d", errno);
+    return t;
+}
+
+static inline void _tcp_frame_free(mb_txn_t *t)
+{
+    t->busy = false;
+    xSemaphoreGive(t->proto == TCP_PROTO_UDP ? s_udp_credits : t->conn->credits);
+    xQueueSend(s_free_frames, &t, 0);
+}
+
+/* Sends as much of the output queue as the socket takes, tx_lock held */
+static void _tcp_conn_flush(tcp_conn_t *c)
+{
+    if(c->tx_len == 0 || c->tx_error)
+        return;
+
+    int r = send(c->sock, c->tx, c->tx_len, MSG_DONTWAIT);
+    if(r < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) /* Window is full, the event loop retries */
+            return;
+        ESP_LOGE(TAG, "Error occurred during sending tcp responce: errno %d", errno);
+        c->tx_error = true;
+        c->tx_len = 0;
+        return;
+    }
+
+    c->tx_len -= r;
+    if(c->tx_len > 0)
+        memmove(c->tx, &c->tx[r], c->tx_len);
+    c->tx_tick = xTaskGetTickCount();
+}
+
+/* Datagram answer, dropped if the stack has no room for it, the master retries */
+/* The answer is gathered from the frame itself, header and PDU, nothing is copied on the caller's stack */
+static void _udp_txn_done(mb_txn_t *t)
+{
+    mb_bus_txn_t *bt = &t->bus;
+
+    t->mbap[0] = t->tid >> 8;
+    t->mbap[1] = t->tid & 0xff;
+    t->mbap[2] = 0; /* Protocol */
+    t->mbap[3] = 0;
+    t->mbap[4] = 0;
+    t->mbap[5] = bt->pdu_len + 1;
+    t->mbap[6] = bt->uid;
+
+    struct iovec iov[2] = {
+        { .iov_base = t->mbap, .iov_len = MB_TCP_MBAP_SIZE },
+        { .iov_base = bt->pdu, .iov_len = bt->pdu_len },
+    };
+    struct msghdr msg = {
+        .msg_name = &t->from,
+        .msg_namelen = sizeof(t->from),
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+
+    if(sendmsg(s_udp_sock, &msg, MSG_DONTWAIT) < 0) {
+        ESP_LOGE(TAG, "Error occurred during sending udp responce: errno %d", errno);
+        s_udp_stats.send_errors++;
+    }
+}
+
+/* len bytes were written behind the output queue, tx_lock held */
+static void _tcp_tx_queued(tcp_conn_t *c, size_t len)
+{
+    /* Behind earlier responses the window is full, they all leave together once it opens */
+    if(c->tx_len == 0) {
+        c->tx_len = len;
+        c->tx_tick = xTaskGetTickCount();
+        _tcp_conn_flush(c);
+    } else
+        c->tx_len += len;
+}
+
+/* Called from the bus task, the response PDU replaced the request */
+static void _tcp_txn_done(mb_bus_txn_t *bt)
+{
+    mb_txn_t *t = (mb_txn_t *)bt;
+    tcp_conn_t *c = t->conn;
+
+    if(bt->pdu_len == 0) { /* Broadcast, nobody answers */
+        _tcp_frame_free(t);
+        return;
+    }
+
+    if(t->proto == TCP_PROTO_UDP) {
+        _udp_txn_done(t);
+        _tcp_frame_free(t);
+        return;
+    }
+
+    xSemaphoreTake(c->tx_lock, portMAX_DELAY);
+
+    size_t len = (c->proto == TCP_PROTO_RTU) ? 1 + bt->pdu_len + 2 : MB_TCP_FUNC + bt->pdu_len;
+    if(c->tx_error) {
+        /* Connection is going away, nobody reads the response */
+    } else if(c->tx_len + len > TCP_TX_QUEUE_SIZE) {
+        ESP_LOGW(TAG, "Output queue of %s full, dropping slow consumer", c->addr_str);
+        s_tcp_slow_drops++;
+        c->tx_error = true;
+        c->tx_len = 0;
+    } else if(c->proto == TCP_PROTO_RTU) {
+        uint8_t *p = &c->tx[c->tx_len];
+        p[0] = bt->uid;
+        memcpy(&p[1], bt->pdu, bt->pdu_len);
+        uint16_t crc = mb_serial_crc16(p, 1 + bt->pdu_len);
+        p[1 + bt->pdu_len] = crc & 0xff;
+        p[2 + bt->pdu_len] = crc >> 8;
+        _tcp_tx_queued(c, len);
+    } else {
+        uint8_t *p = &c->tx[c->tx_len];
+        p[0] = t->tid >> 8;
+        p[1] = t->tid & 0xff;
+
+        p[2] = 0; /* Protocol */
+        p[3] = 0;
+
+        p[4] = 0;
+        p[5] = bt->pdu_len + 1; // Number of bytes after this one.
+
+        p[6] = bt->uid;
+        memcpy(&p[MB_TCP_FUNC], bt->pdu, bt->pdu_len);
+        _tcp_tx_queued(c, len);
+    }
+
+    xSemaphoreGive(c->tx_lock);
+
+    _tcp_frame_free(t);
+}
+
+/* Configured placement first, the other memory if it is full or absent */
+static void *_tcp_pool_alloc(size_t sz)
+{
+    void *p = heap_caps_calloc(1, sz, TCP_POOL_CAPS);
+    if(p == NULL) {
+        ESP_LOGW(TAG, "Gateway pool of %u bytes not in preferred memory", (unsigned)sz);
+        p = heap_caps_calloc(1, sz, MALLOC_CAP_DEFAULT);
+    }
+
+    if(p && esp_ptr_external_ram(p))
+        s_tcp_pool_psram = true;
+    return p;
+}
+
+void initialize_modbus_tcp2serial()
+{
+    s_limits_mutex = xSemaphoreCreateMutex();
+
+    s_tcp_conns = (tcp_conn_t *)_tcp_pool_alloc(MAX_TCP_CONNECTIONS * sizeof(tcp_conn_t));
+    s_tcp_frames = (mb_txn_t *)_tcp_pool_alloc(TCP_FRAME_POOL_SIZE * sizeof(mb_txn_t));
+    s_free_frames = xQueueCreate(TCP_FRAME_POOL_SIZE, sizeof(mb_txn_t *));
+    if(s_tcp_conns == NULL || s_tcp_frames == NULL || s_free_frames == NULL) {
+        ESP_LOGE(TAG, "No memory for the gateway pools !!!");
+        s_tcp_conns = NULL;
+        return;
+    }
+
+    for(int i=0; i<MAX_TCP_CONNECTIONS; i++) {
+        tcp_conn_t *c = &s_tcp_conns[i];
+        c->state = TCP_CONN_FREE;
+        c->sock = -1;
+        c->credits = xSemaphoreCreateCounting(MAX_PIPELINE_DEPTH, MAX_PIPELINE_DEPTH);
+        c->tx_lock = xSemaphoreCreateMutex();
+    }
+
+    for(int i=0; i<TCP_FRAME_POOL_SIZE; i++) {
+        mb_txn_t *t = &s_tcp_frames[i];
+        t->bus.done = &_tcp_txn_done;
+        xQueueSend(s_free_frames, &t, 0);
+    }
+
+    mb_bus_client_init(&s_udp_client, 1);
+    s_udp_credits = xSemaphoreCreateCounting(MAX_PIPELINE_DEPTH, MAX_PIPELINE_DEPTH);
+
+    mb_tcp2serial_load_config();
+
+	modbus_tcp_slave_init(MB_TCP_PORT_NUMBER);
+}
+
+static void _bucket_refill(tcp_bucket_t *k, uint16_t rps, uint16_t bus_ms, uint32_t now)
+{
+    uint32_t ms = (now - k->tick) * portTICK_PERIOD_MS;
+    k->tick = now;
+    if(ms > 1000)
+        ms = 1000;
+
+    /* rps requests a second is rps thousandths a millisecond, bus_ms likewise in microseconds */
+    k->requests += ms * rps;
+    if(k->requests > rps * 1000)
+        k->requests = rps * 1000;
+    k->bus_us += ms * bus_ms;
+    if(k->bus_us > bus_ms * 1000)
+        k->bus_us = bus_ms * 1000;
+}
+
+static void _bucket_reset(tcp_bucket_t *k, uint16_t rps, uint16_t bus_ms)
+{
+    k->requests = rps * 1000;
+    k->bus_us = bus_ms * 1000;
+    k->tick = xTaskGetTickCount();
+}
+
+/* A limit of 0 is unlimited. The bus time bucket may go into debt for one large request */
+static inline bool _bucket_allows(const tcp_bucket_t *k, uint16_t rps, uint16_t bus_ms)
+{
+    return (rps == 0 || k->requests >= 1000) && (bus_ms == 0 || k->bus_us > 0);
+}
+
+/* Only the limited buckets are charged, the debt stops at one second worth so it cannot wrap */
+static inline void _bucket_take(tcp_bucket_t *k, uint16_t rps, uint16_t bus_ms, uint32_t cost_us)
+{
+    if(rps != 0)
+        k->requests -= 1000;
+    if(bus_ms != 0) {
+        k->bus_us -= (cost_us > bus_ms * 1000) ? bus_ms * 1000 : (int32_t)cost_us;
+        if(k->bus_us < -(int32_t)(bus_ms * 1000))
+            k->bus_us = -(int32_t)(bus_ms * 1000);
+    }
+}
+
+/* Charges the request to the connection and its address, false if either is over its limit */
+static bool _tcp_admit(tcp_conn_t *c, const mb_bus_txn_t *bt, const mb_tcp_limits_t *l)
+{
+    uint32_t now = xTaskGetTickCount();
+
+    c->requests++;
+
+    if(l->conn_rps == 0 && l->conn_bus_ms == 0 && l->ip_rps == 0 && l->ip_bus_ms == 0)
+        return true;
+
+    _bucket_refill(&c->bucket, l->conn_rps, l->conn_bus_ms, now);
+    _bucket_refill(&c->peer->bucket, l->ip_rps, l->ip_bus_ms, now);
+
+    if(_bucket_allows(&c->bucket, l->conn_rps, l->conn_bus_ms) == false ||
+        _bucket_allows(&c->peer->bucket, l->ip_rps, l->ip_bus_ms) == false) {
+        c->requests--; /* Counted once it is admitted */
+        return false;
+    }
+
+    uint32_t cost_us = mb_bus_cost_us(bt->uid, bt->pdu, bt->pdu_len);
+    _bucket_take(&c->bucket, l->conn_rps, l->conn_bus_ms, cost_us);
+    _bucket_take(&c->peer->bucket, l->ip_rps, l->ip_bus_ms, cost_us);
+
+    return true;
+}
+
+/* Entry of addr_str, a free one or the least recently used UDP only one when it is new */
+static tcp_peer_t *_tcp_peer_find(const char *addr_str)
+{
+    tcp_peer_t *free_peer = NULL;
+
+    for(int i=0; i<sizeof(s_tcp_peers) / sizeof(s_tcp_peers[0]); i++) {
+        tcp_peer_t *p = &s_tcp_peers[i];
+        if((p->conns != 0 || p->udp) && strcmp(p->addr_str, addr_str) == 0)
+            return p;
+        if(p->conns != 0)
+            continue;
+        if(free_peer == NULL || (free_peer->udp && (p->udp == false || (int32_t)(p->udp_tick - free_peer->udp_tick) < 0)))
+            free_peer = p;
+    }
+
+    /* There is always one, connections hold at most MAX_TCP_CONNECTIONS entries */
+    snprintf(free_peer->addr_str, sizeof(free_peer->addr_str), "%s", addr_str);
+    free_peer->conns = 0;
+    free_peer->udp = false;
+    free_peer->throttled = 0;
+    mb_tcp_limits_t l;
+    mb_tcp2serial_get_limits(&l);
+    _bucket_reset(&free_peer->bucket, l.ip_rps, l.ip_bus_ms);
+
+    return free_peer;
+}
+
+static tcp_peer_t *_tcp_peer_get(const char *addr_str)
+{
+    tcp_peer_t *p = _tcp_peer_find(addr_str);
+    p->conns++;
+
+    return p;
+}
+
+/* Charges a datagram to its source address, false if the address is over its limit */
+static bool _udp_admit(const struct sockaddr_in *from, const mb_bus_txn_t *bt, const mb_tcp_limits_t *l)
+{
+    if(l->ip_rps == 0 && l->ip_bus_ms == 0)
+        return true;
+
+    char addr_str[32] = "";
+    inet_ntoa_r(from->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
+
+    uint32_t now = xTaskGetTickCount();
+    tcp_peer_t *p = _tcp_peer_find(addr_str);
+    p->udp = true;
+    p->udp_tick = now;
+
+    _bucket_refill(&p->bucket, l->ip_rps, l->ip_bus_ms, now);
+    if(_bucket_allows(&p->bucket, l->ip_rps, l->ip_bus_ms) == false) {
+        p->throttled++;
+        return false;
+    }
+
+    _bucket_take(&p->bucket, l->ip_rps, l->ip_bus_ms, mb_bus_cost_us(bt->uid, bt->pdu, bt->pdu_len));
+
+    return true;
+}
+
+static inline bool _tcp_conn_idle(tcp_conn_t *c)
+{
+    return uxSemaphoreGetCount(c->credits) == MAX_PIPELINE_DEPTH;
+}
+
+/* Rate limits t and queues it to the bus, false if it has to wait in the ring (t is given back) */
+static bool _tcp_frame_submit(tcp_conn_t *c, mb_txn_t *t)
+{
+    if(mb_local_submit(&t->bus)) { /* Answered at once, costs no bus time */
+        c->requests++;
+        return true;
+    }
+
+    mb_tcp_limits_t l;
+    mb_tcp2serial_get_limits(&l);
+
+    if(_tcp_admit(c, &t->bus, &l) == false) {
+        if(c->held == false) { /* Once per request, not on every loop it waits */
+            c->throttled++;
+            c->peer->throttled++;
+        }
+        if(l.reject == false) { /* Try again on the next loop, the bucket refills meanwhile */
+            c->held = true;
+            _tcp_frame_free(t);
+            return false;
+        }
+        t->bus.pdu[0] |= 0x80;
+        t->bus.pdu[1] = MB_EX_SLAVE_DEVICE_BUSY;
+        t->bus.pdu_len = 2;
+        _tcp_txn_done(&t->bus);
+        return true;
+    }
+
+    c->held = false;
+    mb_bus_submit(&t->bus);
+    return true;
+}
+
+/*
+* Cut every complete MBAP frame out of the receive ring and queue it to the bus task.
+* Frames stay in the ring while the connection has no idle transaction slot.
+* Returns -1 on a malformed header, the stream cannot be resynchronized after that.
+*/
+static int _dispatch_mbap(tcp_conn_t *c)
+{
+    mbap_ring_t *r = &c->rx;
+
+    while(_ring_used(r) >= MB_TCP_MBAP_SIZE) {
+        uint16_t protocol = _ring_peek16(r, MB_TCP_PID);
+        uint16_t tcplen = _ring_peek16(r, MB_TCP_LEN);
+
+        if(protocol != 0 || tcplen < 2 || tcplen > MB_PDU_SIZE_MAX + 1) {
+            ESP_LOGE(TAG, "Invalid MBAP header from %s (protocol %d, length %d)", c->addr_str, protocol, tcplen);
+            return -1;
+        }
+
+        size_t flen = MB_TCP_UID + tcplen;
+        if(_ring_used(r) < flen) /* Partial frame, wait for the rest */
             break;
-        } else if (len == 0) {
-            ESP_LOGI(TAG, "Connection closed");
+
+        mb_txn_t *t = _tcp_frame_take(c->credits);
+        if(t == NULL)
             break;
-        } else { // Data received
-            tcp_rx_buf[len] = 0; // Null-terminate whatever we received and treat like a string
-            ESP_LOGI(TAG, "Received %d bytes from %s:", len, addr_str);
-            //ESP_LOGI(TAG, "%s", tcp_rx_buf);
-#if 0
-            uint16_t transaction = (*(tcp_rx_buf + MB_TCP_TID) << 8) + *(tcp_rx_buf + MB_TCP_TID + 1);
-            uint16_t protocol = (*(tcp_rx_buf + MB_TCP_PID) << 8) + *(tcp_rx_buf + MB_TCP_PID + 1);
-            uint16_t tcplen = (*(tcp_rx_buf + MB_TCP_LEN) << 8) + *(tcp_rx_buf + MB_TCP_LEN + 1);
-#endif                
-            uint8_t slaveId = *(tcp_rx_buf + MB_TCP_UID);
-            uint8_t function = *(tcp_rx_buf + MB_TCP_FUNC);
-            uint16_t startAddr = (*(tcp_rx_buf + MB_TCP_REGISTER_START) << 8) + *(tcp_rx_buf + MB_TCP_REGISTER_START + 1);
-            uint16_t numRegs = (*(tcp_rx_buf + MB_TCP_REGISTER_NUMBER) << 8) + *(tcp_rx_buf + MB_TCP_REGISTER_NUMBER + 1);
-#if 0
-            ESP_LOGI(TAG, "==========  TCP -> RTU ==========");
-            ESP_LOGI(TAG, "Transaction ID: %d", transaction);
-            ESP_LOGI(TAG, "Protocol ID: %d", protocol);
-            ESP_LOGI(TAG, "Length: %d", tcplen);
-            ESP_LOGI(TAG, "Slave ID: %d", slaveId);
-            ESP_LOGI(TAG, "Function Code: %d", function);
-            ESP_LOGI(TAG, "Start Address: %d (0x%x)", startAddr, startAddr);
-            ESP_LOGI(TAG, "Number Registers: %d", numRegs);
-#endif
-            tcp_tx_buf[0] = *(tcp_rx_buf + MB_TCP_TID);
-            tcp_tx_buf[1] = *(tcp_rx_buf + MB_TCP_TID + 1);
-            
-            tcp_tx_buf[2] = 0; /* Protocol */
-            tcp_tx_buf[3] = 0;                    
-            
-            tcp_tx_buf[4] = 0;
-            tcp_tx_buf[5] = (numRegs * 2) + 3; // Number of bytes after this one.
-            
-            tcp_tx_buf[6] = slaveId;
-            tcp_tx_buf[7] = function;
-            tcp_tx_buf[8] = numRegs * 2;
-            
-            len = 9 + (numRegs * 2);
-#define PARAM_BUF_SIZE 256
-            uint8_t param_buffer[PARAM_BUF_SIZE] = {0};
-
-            esp_err_t err;
-            if(len > 255) { /* Overflow !!! */
-                err = ESP_ERR_INVALID_ARG;
-            } else {
-                // Execute modbus request
-                mb_param_request_t modbus_request = {
-                    slaveId,
-                    function,
-                    startAddr,
-                    numRegs
-                };
-xSemaphoreTake(mbc_mutex, portMAX_DELAY);
-                err = mbc_master_send_request(&modbus_request, &param_buffer[0]);
-xSemaphoreGive(mbc_mutex);
-            }
-            
-            if(err == ESP_OK) {
-                switch(function)    {
-                    case MB_FUNC_READ_INPUT_REGISTER:
-                    case MB_FUNC_READ_HOLDING_REGISTERS:
-#if 0
-                        ESP_LOGI(TAG, "==========  RTU -> TCP ==========");
-#endif
-                        for(int i=0; i<numRegs; i++) {
-#if 0                            
-                            ESP_LOGI(TAG, "0x%02x 0x%02x", *(param_buffer + (i * 2)), *(param_buffer + (i * 2) + 1));
-#endif
-                            tcp_tx_buf[9 + (i * 2)] = *(param_buffer + (i * 2));
-                            tcp_tx_buf[9 + (i * 2 + 1)] = *(param_buffer + (i * 2) + 1);
-                        }
-                        break;
-                    /*
-                    case MB_FUNC_READ_COILS:
-                    case MB_FUNC_WRITE_SINGLE_COIL:
-                    case MB_FUNC_WRITE_MULTIPLE_COILS:
-                    case MB_FUNC_READ_DISCRETE_INPUTS:
-                    
-                    case MB_FUNC_WRITE_REGISTER:
-                    case MB_FUNC_WRITE_MULTIPLE_REGISTERS:
-                    case MB_FUNC_READWRITE_MULTIPLE_REGISTERS:
-                    */
-                    default:
-                        for(int i=0; i<(numRegs * 2); i++) {
-                            tcp_tx_buf[9 + i] = *(param_buffer + i);
-                        }
-                        break;
-                }
-                //len = 9 + (numRegs * 2);
-            } else {
-#if 0
-                ESP_LOGI(TAG, "==========  RTU -> TCP ========== ERROR %d", err);
-#endif
-                tcp_tx_buf[5] = 4; // Number of bytes after this one.
-                tcp_tx_buf[7] = function + 0x80;
-                
-                tcp_tx_buf[8] = 1; //Number of bytes after this one (or number of bytes of data).
-                tcp_tx_buf[9] = 11; //Error code: Gateway Target Device Failed to Respond
 
-                len = 10;
-            }
+        t->conn = c;
+        t->proto = TCP_PROTO_MBAP;
+        t->bus.client = &c->client;
+        t->tid = _ring_peek16(r, MB_TCP_TID);
+        t->bus.uid = _ring_peek(r, MB_TCP_UID);
+        t->bus.pdu_len = tcplen - 1;
+        _ring_copy(r, MB_TCP_FUNC, t->bus.pdu, t->bus.pdu_len);
 
-                //ESP_LOGW(TAG, "Received packet from rtu, len: %d", msg.length);
-            int r = send(sock, tcp_tx_buf, len, 0);
-            if (r < 0) {
-                    ESP_LOGE(TAG, "Error occurred during sending tcp responce: errno %d", errno);
-            }
+        if(_tcp_frame_submit(c, t) == false)
+            break;
+
+        r->tail += flen;
+    }
+
+    return 0;
+}
+
+/* Length of the RTU request at the tail of the ring, 0 while its header is incomplete, -1 if unknown */
+static int _rtu_frame_len(const mbap_ring_t *r)
+{
+    size_t used = _ring_used(r);
+    if(used < 2)
+        return 0;
+
+    switch(_ring_peek(r, 1)) {
+    case 1: case 2: case 3: case 4: case 5: case 6: case 8:
+        return 8;
+    case 7: case 11: case 12: case 17:
+        return 4;
+    case 15: case 16: /* Byte count after address and quantity */
+        return used < 7 ? 0 : 9 + _ring_peek(r, 6);
+    case 22:
+        return 10;
+    case 23: /* Byte count after the read and the write ranges */
+        return used < 11 ? 0 : 13 + _ring_peek(r, 10);
+    case 43: /* Read device identification */
+        return 7;
+    default:
+        return -1;
+    }
+}
+
+/*
+* Same for RTU frames. The next request is cut once the previous one is answered.
+* Returns -1 on an unknown function code or a CRC error, TCP does not corrupt data
+* so the framing is lost.
+*/
+static int _dispatch_rtu(tcp_conn_t *c)
+{
+    mbap_ring_t *r = &c->rx;
+
+    while(1) {
+        int flen = _rtu_frame_len(r);
+        if(flen < 0 || flen > RTU_FRAME_SIZE_MAX) {
+            ESP_LOGE(TAG, "Invalid RTU frame from %s (function %d)", c->addr_str, _ring_peek(r, 1));
+            return -1;
         }
+        if(flen == 0 || _ring_used(r) < flen) /* Partial frame, wait for the rest */
+            break;
+
+        if(_tcp_conn_idle(c) == false) /* Answers must keep the order of requests */
+            break;
+
+        _ring_copy(r, 0, s_rx_frame, flen);
+        if(mb_serial_crc16(s_rx_frame, flen) != 0) {
+            ESP_LOGE(TAG, "Invalid RTU frame from %s (CRC error)", c->addr_str);
+            return -1;
+        }
+
+        mb_txn_t *t = _tcp_frame_take(c->credits);
+        if(t == NULL)
+            break;
+
+        t->conn = c;
+        t->proto = TCP_PROTO_RTU;
+        t->bus.client = &c->client;
+        t->bus.uid = s_rx_frame[0];
+        t->bus.pdu_len = flen - 3;
+        memcpy(t->bus.pdu, &s_rx_frame[1], t->bus.pdu_len);
+
+        if(_tcp_frame_submit(c, t) == false)
+            break;
+
+        r->tail += flen;
     }
 
-    if (sock != -1) {
-        ESP_LOGE(TAG, "Shutting down socket and restarting...");
-        shutdown(sock, 0);
-        close(sock);
+    return 0;
+}
+
+static inline int _dispatch_frames(tcp_conn_t *c)
+{
+    return (c->proto == TCP_PROTO_RTU) ? _dispatch_rtu(c) : _dispatch_mbap(c);
+}
+
+/* A retransmit of a request still in progress, the answer to the first one serves both */
+static bool _udp_in_progress(const struct sockaddr_in *from, uint16_t tid)
+{
+    for(int i=0; i<TCP_FRAME_POOL_SIZE; i++) {
+        const mb_txn_t *t = &s_tcp_frames[i];
+        if(t->busy && t->proto == TCP_PROTO_UDP && t->tid == tid &&
+            t->from.sin_addr.s_addr == from->sin_addr.s_addr && t->from.sin_port == from->sin_port)
+            return true;
+    }
+
+    return false;
+}
+
+/* False once no datagram is waiting */
+static bool _udp_read()
+{
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+
+    int len = recvfrom(s_udp_sock, s_rx_frame, TCP_TX_BUF_SIZE, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+    if(len < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+        return false;
+    }
+
+    uint16_t tid = (s_rx_frame[MB_TCP_TID] << 8) + s_rx_frame[MB_TCP_TID + 1];
+    uint16_t protocol = (s_rx_frame[MB_TCP_PID] << 8) + s_rx_frame[MB_TCP_PID + 1];
+    uint16_t udplen = (s_rx_frame[MB_TCP_LEN] << 8) + s_rx_frame[MB_TCP_LEN + 1];
+
+    /* One frame per datagram, nothing to resynchronize, a bad one is just ignored */
+    if(len < MB_TCP_MBAP_SIZE + 1 || protocol != 0 || udplen < 2 || MB_TCP_UID + udplen != len) {
+        s_udp_stats.invalid++;
+        return true;
+    }
+
+    s_udp_stats.requests++;
+
+    if(_udp_in_progress(&from, tid)) {
+        s_udp_stats.duplicates++;
+        return true;
     }
 
+    mb_txn_t *t = _tcp_frame_take(s_udp_credits);
+    if(t == NULL) {
+        s_udp_stats.dropped++;
+        return true;
+    }
+
+    t->conn = NULL;
+    t->proto = TCP_PROTO_UDP;
+    t->bus.client = &s_udp_client;
+    t->tid = tid;
+    memcpy(&t->from, &from, sizeof(from));
+    t->bus.uid = s_rx_frame[MB_TCP_UID];
+    t->bus.pdu_len = udplen - 1;
+    memcpy(t->bus.pdu, &s_rx_frame[MB_TCP_FUNC], t->bus.pdu_len);
+
+    if(mb_local_submit(&t->bus)) /* Answered at once, costs no bus time */
+        return true;
+
+    mb_tcp_limits_t l;
+    mb_tcp2serial_get_limits(&l);
+
+    if(_udp_admit(&from, &t->bus, &l) == false) {
+        s_udp_stats.throttled++;
+        if(l.reject == false) { /* Nothing holds a datagram back, the master retries */
+            _tcp_frame_free(t);
+            return true;
+        }
+        t->bus.pdu[0] |= 0x80;
+        t->bus.pdu[1] = MB_EX_SLAVE_DEVICE_BUSY;
+        t->bus.pdu_len = 2;
+        _tcp_txn_done(&t->bus);
+        return true;
+    }
+
+    mb_bus_submit(&t->bus);
+
+    return true;
+}
+
+/* Queued output made no progress for too long */
+static inline bool _tcp_conn_stalled(tcp_conn_t *c, uint32_t now)
+{
+    return c->tx_len > 0 && (now - c->tx_tick) * portTICK_PERIOD_MS > CONFIG_MB_GATEWAY_SEND_TIMEOUT_MS;
+}
+
+/* Drops queued and later output, the connection closes once nothing is in flight */
+static void _tcp_conn_drop(tcp_conn_t *c)
+{
+    xSemaphoreTake(c->tx_lock, portMAX_DELAY);
+    c->tx_error = true;
+    c->tx_len = 0;
+    xSemaphoreGive(c->tx_lock);
+
+    c->state = TCP_CONN_CLOSING;
+}
+
+static tcp_conn_t *_tcp_conn_alloc(int sock, const char *addr_str, uint8_t proto)
+{
+    for(int i=0; i<MAX_TCP_CONNECTIONS; i++) {
+        tcp_conn_t *c = &s_tcp_conns[i];
+        if(c->state != TCP_CONN_FREE)
+            continue;
+
+        c->sock = sock;
+        c->proto = proto;
+        snprintf(c->addr_str, sizeof(c->addr_str), "%s", addr_str);
+        c->rx.head = 0;
+        c->rx.tail = 0;
+        c->last_tick = xTaskGetTickCount();
+        mb_bus_client_init(&c->client, 1);
+        mb_tcp_limits_t l;
+        mb_tcp2serial_get_limits(&l);
+        c->peer = _tcp_peer_get(addr_str);
+        _bucket_reset(&c->bucket, l.conn_rps, l.conn_bus_ms);
+        c->held = false;
+        c->requests = 0;
+        c->throttled = 0;
+        c->tx_error = false;
+        c->tx_len = 0;
+        c->state = TCP_CONN_OPEN;
+        s_num_tcp_connections++;
+        if(s_num_tcp_connections > s_tcp_conns_peak)
+            s_tcp_conns_peak = s_num_tcp_connections;
+        return c;
+    }
+
+    return NULL;
+}
+
+static void _tcp_conn_release(tcp_conn_t *c)
+{
+    ESP_LOGI(TAG, "Shutting down socket of %s", c->addr_str);
+    shutdown(c->sock, 0);
+    close(c->sock);
+
+    c->sock = -1;
+    c->peer->conns--;
+    c->peer = NULL;
+    c->state = TCP_CONN_FREE;
     s_num_tcp_connections--;
+}
 
-    vTaskDelete(NULL);
+static void _tcp_conn_read(tcp_conn_t *c)
+{
+    uint8_t *p;
+    size_t span = _ring_write_span(&c->rx, &p);
+
+    int len = recv(c->sock, p, span, 0);
+    if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    } else if(len < 0) { // Error occurred during receiving
+        ESP_LOGE(TAG, "recv failed: errno %d", errno);
+        c->state = TCP_CONN_CLOSING;
+    } else if (len == 0) {
+        ESP_LOGI(TAG, "Connection closed");
+        c->state = TCP_CONN_CLOSING;
+    } else { // Data received
+        ESP_LOGI(TAG, "Received %d bytes from %s:", len, c->addr_str);
+        c->last_tick = xTaskGetTickCount();
+        c->rx.head += len;
+        if(_dispatch_frames(c) < 0)
+            c->state = TCP_CONN_CLOSING;
+    }
 }
 
-void mbTcp2Serial_task(void *pvParameters)
+/* Frees the slot of the least recently active connection with nothing in flight or queued, false if none */
+static bool _tcp_conn_evict()
 {
-    char addr_str[32];
-    int addr_family;
-    int ip_protocol;
+    tcp_conn_t *lru = NULL;
+
+    for(int i=0; i<MAX_TCP_CONNECTIONS; i++) {
+        tcp_conn_t *c = &s_tcp_conns[i];
+        if(c->state != TCP_CONN_OPEN || _tcp_conn_idle(c) == false || c->tx_len > 0)
+            continue;
+        if(lru == NULL || (int32_t)(c->last_tick - lru->last_tick) < 0)
+            lru = c;
+    }
+
+    if(lru == NULL)
+        return false;
+
+    ESP_LOGW(TAG, "Out of connections, evicting %s idle for %u ms", lru->addr_str,
+        (unsigned)((xTaskGetTickCount() - lru->last_tick) * portTICK_PERIOD_MS));
+    _tcp_conn_release(lru);
+
+    return true;
+}
+
+static void _tcp_conn_keepalive(int sock)
+{
+    int keepalive = 1;
+    int idle = CONFIG_MB_GATEWAY_KEEPALIVE_S;
+    int interval = TCP_KEEPALIVE_INTERVAL_S;
+    int count = TCP_KEEPALIVE_COUNT;
+
+    if(setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(int)) < 0 ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int)) < 0 ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int)) < 0 ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(int)) < 0) {
+        ESP_LOGE(TAG, "setsockopt keepalive %d", errno);
+    }
+}
+
+static void _tcp_accept(int listen_sock, uint8_t proto)
+{
+    char addr_str[32] = "";
+    struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+    uint addr_len = sizeof(source_addr);
+    int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        int err = errno;
+        ESP_LOGE(TAG, "Unable to accept connection: errno %d", err);
+        /* Out of sockets, lwIP reset that client, its next attempt finds the one given back */
+        if(err == ENFILE || err == EMFILE)
+            _tcp_conn_evict();
+        return;
+    }
+    ESP_LOGI(TAG, "Socket accepted");
 
+    if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        ESP_LOGE(TAG, "fcntl %d", errno);
+    }
+
+    int nodelay = 1;
+    if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&nodelay, sizeof(int)) < 0) {
+        ESP_LOGE(TAG, "setsockopt %d", errno);
+    }
+
+    if(CONFIG_MB_GATEWAY_KEEPALIVE_S > 0)
+        _tcp_conn_keepalive(sock);
+
+    // Get the sender's ip address as string
+    if(source_addr.sin6_family == PF_INET) {
+        inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
+    } else if (source_addr.sin6_family == PF_INET6) {
+        inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+    }
+
+    if(s_num_tcp_connections >= MAX_TCP_CONNECTIONS)
+        _tcp_conn_evict();
+
+    if(_tcp_conn_alloc(sock, addr_str, proto) == NULL) {
+        ESP_LOGE(TAG, "No free connection for %s", addr_str);
+        shutdown(sock, 0);
+        close(sock);
+    }
+}
+
+#define TCP_LOOP_POLL_MS 10 // Select timeout, picks up slots given back by the bus task
+
+/* Bound socket, listening if type is SOCK_STREAM, -1 on error */
+static int _tcp_socket(uint16_t port, int type)
+{
     struct sockaddr_in dest_addr;
     dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(s_tcp_port);
-    addr_family = AF_INET;
-    ip_protocol = IPPROTO_IP;
-    inet_ntoa_r(dest_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
+    dest_addr.sin_port = htons(port);
 
-    int listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
-    if (listen_sock < 0)
+    int sock = socket(AF_INET, type, IPPROTO_IP);
+    if (sock < 0) {
         ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-    else
-    	ESP_LOGI(TAG, "Socket created");
-#if 0
-    /* Set socket option */
-    int flag = 1;
-    if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int)) < 0) {
-        ESP_LOGE(TAG, "setsockopt %d", errno);
+        return -1;
     }
-#endif
-    //setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-    int err = bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    ESP_LOGI(TAG, "Socket created");
+
+    int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
     if (err != 0)
         ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
     else
-    	ESP_LOGI(TAG, "Socket bound, port %d", s_tcp_port);
+    	ESP_LOGI(TAG, "Socket bound, port %d", port);
+
+    if(type != SOCK_STREAM)
+        return sock;
+
+    err = listen(sock, 2);
+    if (err != 0) {
+        ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+    ESP_LOGI(TAG, "Socket listening");
+
+    return sock;
+}
+
+//
+// Stack check : cache hits, the virtual map and UDP answers all run on this
+// task's stack. The least free stack seen is kept for mbtcp pool, and logged
+// once it drops below TCP_STACK_LOW bytes.
+//
+#define TCP_STACK_LOW 512
+
+static uint32_t s_stack_free = UINT32_MAX;
+
+static inline void _tcp_stack_check()
+{
+    uint32_t free = uxTaskGetStackHighWaterMark(NULL);
+    if(free >= s_stack_free)
+        return;
+
+    s_stack_free = free;
+    if(free < TCP_STACK_LOW)
+        ESP_LOGW(TAG, "mbTcp2Serial_task stack low, %u bytes never used", (unsigned)free);
+}
+
+void mbTcp2Serial_task(void *pvParameters)
+{
+    if(s_tcp_conns == NULL) { /* Pools not allocated */
+        vTaskDelete(NULL);
+        return;
+    }
+
+    int listen_sock = _tcp_socket(s_tcp_port, SOCK_STREAM);
+    if(listen_sock < 0) {
+        vTaskDelete(NULL);
+        return;
+    }
+
+    int rtu_sock = (RTU_TCP_PORT_NUMBER > 0) ? _tcp_socket(RTU_TCP_PORT_NUMBER, SOCK_STREAM) : -1;
+    if(UDP_PORT_NUMBER > 0)
+        s_udp_sock = _tcp_socket(UDP_PORT_NUMBER, SOCK_DGRAM);
 
     while (1) {
-        err = listen(listen_sock, 1);
-        if (err != 0) {
-            ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
-            break;
-        }
-        ESP_LOGI(TAG, "Socket listening");
+        fd_set rfds;
+        fd_set wfds;
+        int maxfd = -1;
 
-        struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-        uint addr_len = sizeof(source_addr);
-        int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-            continue;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+
+        /* Also when full, a new client may take the place of an idle one */
+        FD_SET(listen_sock, &rfds);
+        maxfd = listen_sock;
+        if(rtu_sock >= 0) {
+            FD_SET(rtu_sock, &rfds);
+            if(rtu_sock > maxfd)
+                maxfd = rtu_sock;
         }
-        ESP_LOGI(TAG, "Socket accepted");
 
-        int nodelay = 1;
-        if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&nodelay, sizeof(int)) < 0) {
-            ESP_LOGE(TAG, "setsockopt %d", errno);
+        /* Datagrams wait in the stack while UDP requests are all in progress */
+        if(s_udp_sock >= 0 && uxSemaphoreGetCount(s_udp_credits) > 0) {
+            FD_SET(s_udp_sock, &rfds);
+            if(s_udp_sock > maxfd)
+                maxfd = s_udp_sock;
         }
 
-        // Get the sender's ip address as string
-        if(source_addr.sin6_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-        } else if (source_addr.sin6_family == PF_INET6) {
-            inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+        uint32_t now = xTaskGetTickCount();
+
+        for(int i=0; i<MAX_TCP_CONNECTIONS; i++) {
+            tcp_conn_t *c = &s_tcp_conns[i];
+
+            if(c->state == TCP_CONN_FREE)
+                continue;
+
+            if(_tcp_conn_stalled(c, now)) {
+                ESP_LOGW(TAG, "Output of %s stalled, dropping slow consumer", c->addr_str);
+                s_tcp_slow_drops++;
+                _tcp_conn_drop(c);
+            } else if(c->tx_error && c->state == TCP_CONN_OPEN)
+                c->state = TCP_CONN_CLOSING;
+
+            /* Also while closing, answers to the last requests still go out */
+            if(c->tx_len > 0) {
+                FD_SET(c->sock, &wfds);
+                if(c->sock > maxfd)
+                    maxfd = c->sock;
+            }
+
+            if(c->state == TCP_CONN_CLOSING) {
+                if(_tcp_conn_idle(c) && c->tx_len == 0)
+                    _tcp_conn_release(c);
+                continue;
+            }
+
+            if(CONFIG_MB_GATEWAY_IDLE_TIMEOUT_S > 0 && _tcp_conn_idle(c) && c->tx_len == 0 &&
+                (now - c->last_tick) * portTICK_PERIOD_MS > CONFIG_MB_GATEWAY_IDLE_TIMEOUT_S * 1000) {
+                ESP_LOGI(TAG, "Closing idle connection of %s", c->addr_str);
+                c->state = TCP_CONN_CLOSING;
+                continue;
+            }
+
+            /* Frames left in the ring while the pipeline was full */
+            if(_dispatch_frames(c) < 0) {
+                c->state = TCP_CONN_CLOSING;
+                continue;
+            }
+
+            if(_ring_used(&c->rx) < TCP_RX_RING_SIZE) {
+                FD_SET(c->sock, &rfds);
+                if(c->sock > maxfd)
+                    maxfd = c->sock;
+            }
         }
 
-        tcp_task_t t;
-        t.sock = sock;
-        strcpy(t.addr_str, addr_str);
+        struct timeval tv = {
+            .tv_sec = 0,
+            .tv_usec = TCP_LOOP_POLL_MS * 1000,
+        };
 
-        s_num_tcp_connections++;
+        int n = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+        if(n < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            vTaskDelay(TCP_LOOP_POLL_MS / portTICK_PERIOD_MS);
+            continue;
+        } else if(n == 0)
+            continue;
 
-        xTaskCreatePinnedToCore(&_tcp_task, "_tcp_task", 3072, (void *)&t, 4, NULL, 0);
+        if(FD_ISSET(listen_sock, &rfds))
+            _tcp_accept(listen_sock, TCP_PROTO_MBAP);
+        if(rtu_sock >= 0 && FD_ISSET(rtu_sock, &rfds))
+            _tcp_accept(rtu_sock, TCP_PROTO_RTU);
+        if(s_udp_sock >= 0 && FD_ISSET(s_udp_sock, &rfds)) {
+            while(uxSemaphoreGetCount(s_udp_credits) > 0 && _udp_read())
+                ;
+        }
 
-        while(s_num_tcp_connections >= MAX_TCP_CONNECTIONS) {
-            vTaskDelay(100);
+        for(int i=0; i<MAX_TCP_CONNECTIONS; i++) {
+            tcp_conn_t *c = &s_tcp_conns[i];
+            if(c->state == TCP_CONN_FREE)
+                continue;
+            if(FD_ISSET(c->sock, &wfds)) {
+                xSemaphoreTake(c->tx_lock, portMAX_DELAY);
+                _tcp_conn_flush(c);
+                xSemaphoreGive(c->tx_lock);
+            }
+            if(c->state == TCP_CONN_OPEN && FD_ISSET(c->sock, &rfds))
+                _tcp_conn_read(c);
         }
+
+        _tcp_stack_check();
     }
 
     vTaskDelete(NULL);
 }
+
+void mb_tcp2serial_set_limits(const mb_tcp_limits_t *limits)
+{
+    xSemaphoreTake(s_limits_mutex, portMAX_DELAY);
+    memcpy(&s_limits, limits, sizeof(mb_tcp_limits_t));
+    xSemaphoreGive(s_limits_mutex);
+}
+
+void mb_tcp2serial_get_limits(mb_tcp_limits_t *limits)
+{
+    xSemaphoreTake(s_limits_mutex, portMAX_DELAY);
+    memcpy(limits, &s_limits, sizeof(mb_tcp_limits_t));
+    xSemaphoreGive(s_limits_mutex);
+}
+
+bool mb_tcp2serial_get_client(int index, mb_tcp_client_t *client)
+{
+    if(s_tcp_conns == NULL || index < 0 || index >= MAX_TCP_CONNECTIONS)
+        return false;
+
+    tcp_conn_t *c = &s_tcp_conns[index];
+    tcp_peer_t *p = c->peer;
+    if(c->state == TCP_CONN_FREE || p == NULL)
+        return false;
+
+    snprintf(client->addr_str, sizeof(client->addr_str), "%s", c->addr_str);
+    client->requests = c->requests;
+    client->throttled = c->throttled;
+    client->addr_throttled = p->throttled;
+    client->idle_ms = (xTaskGetTickCount() - c->last_tick) * portTICK_PERIOD_MS;
+    client->tx_queued = c->tx_len;
+    client->rtu = (c->proto == TCP_PROTO_RTU);
+
+    return true;
+}
+
+void mb_tcp2serial_get_pool(mb_tcp_pool_t *pool)
+{
+    pool->conns = MAX_TCP_CONNECTIONS;
+    pool->conns_used = s_num_tcp_connections;
+    pool->conns_peak = s_tcp_conns_peak;
+    pool->frames = TCP_FRAME_POOL_SIZE;
+    pool->frames_used = s_tcp_conns ? TCP_FRAME_POOL_SIZE - uxQueueMessagesWaiting(s_free_frames) : 0;
+    pool->frames_peak = s_tcp_frames_peak;
+    pool->frame_waits = s_tcp_frame_waits;
+    pool->bytes = MAX_TCP_CONNECTIONS * sizeof(tcp_conn_t) + TCP_FRAME_POOL_SIZE * sizeof(mb_txn_t);
+    pool->stack_free = (s_stack_free == UINT32_MAX) ? 0 : s_stack_free;
+    pool->psram = s_tcp_pool_psram;
+}
+
+void mb_tcp2serial_get_udp_stats(mb_udp_stats_t *stats)
+{
+    memcpy(stats, &s_udp_stats, sizeof(mb_udp_stats_t));
+}
+
+uint32_t mb_tcp2serial_get_slow_drops()
+{
+    return s_tcp_slow_drops;
+}
+
+static nvs_handle my_nvs_handle;
+
+#define CMD_MB_TCP_LIMIT "mb_tcp_limit"
+
+void mb_tcp2serial_load_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    size_t l = sizeof(s_limits);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_TCP_LIMIT, &s_limits, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No rate limit cached ...");
+    }
+
+    nvs_close(my_nvs_handle);
+}
+
+void mb_tcp2serial_save_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_TCP_LIMIT, &s_limits, sizeof(s_limits));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save rate limit !!!");
+
+    nvs_commit(my_nvs_handle);
+    nvs_close(my_nvs_handle);
+}
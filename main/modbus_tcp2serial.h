@@ -6,13 +6,64 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint16_t conn_rps; /* Requests a second per connection, 0 is unlimited */
+    uint16_t conn_bus_ms; /* Bus milliseconds a second per connection, 0 is unlimited */
+    uint16_t ip_rps; /* Same, for all connections from one address */
+    uint16_t ip_bus_ms;
+    bool reject; /* Answer 0x06 over the limit instead of holding the request back */
+} mb_tcp_limits_t;
+
+typedef struct {
+    char addr_str[32];
+    uint32_t requests;
+    uint32_t throttled;
+    uint32_t addr_throttled; /* All connections from the same address */
+    uint32_t idle_ms; /* Since the last data received */
+    uint32_t tx_queued; /* Response bytes the client did not take yet */
+    bool rtu; /* RTU over TCP framing */
+} mb_tcp_client_t;
+
+typedef struct {
+    uint32_t requests;
+    uint32_t duplicates; /* Retransmits of a request still in progress */
+    uint32_t dropped; /* No frame left, the master retries */
+    uint32_t throttled; /* Source address over its limit, dropped or answered 0x06 */
+    uint32_t invalid; /* Not a single MBAP frame */
+    uint32_t send_errors;
+} mb_udp_stats_t;
+
+typedef struct {
+    uint16_t conns;
+    uint16_t conns_used;
+    uint16_t conns_peak; /* High-water mark since boot */
+    uint16_t frames; /* Request frames shared by all connections */
+    uint16_t frames_used; /* Queued or on the bus */
+    uint16_t frames_peak;
+    uint32_t frame_waits; /* Complete requests held back, no frame left */
+    uint32_t bytes;
+    bool psram;
+    uint32_t stack_free; /* Least free stack of the gateway task since boot, 0 before its first request */
+} mb_tcp_pool_t;
 
 void initialize_modbus_tcp2serial();
 
 void mbTcp2Serial_task(void *pvParameters);
 
+void mb_tcp2serial_set_limits(const mb_tcp_limits_t *limits);
+void mb_tcp2serial_get_limits(mb_tcp_limits_t *limits);
+bool mb_tcp2serial_get_client(int index, mb_tcp_client_t *client); /* False if the slot is not connected */
+void mb_tcp2serial_get_pool(mb_tcp_pool_t *pool);
+void mb_tcp2serial_get_udp_stats(mb_udp_stats_t *stats);
+uint32_t mb_tcp2serial_get_slow_drops(); /* Connections dropped for not reading their responses */
+
+void mb_tcp2serial_load_config();
+void mb_tcp2serial_save_config();
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -1,16 +0,0 @@
-#ifndef _MODBUS_TCP_SLAVE_H
-#define _MODBUS_TCP_SLAVE_H
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-#include <stdint.h>
-
-void mbTcpSlaveTask(void *pvParameters);
-
-#ifdef __cplusplus
-}
-#endif
-
-#endif
\ No newline at end of file
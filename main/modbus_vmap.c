@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "nvs_flash.h"
+
+#include "sdkconfig.h"
+
+#include "esp32_malloc.h"
+#include "modbus_bus.h"
+#include "modbus_vmap.h"
+
+static const char *TAG = "mb_vmap";
+
+//
+// Virtual units : the register space of a virtual unit ID is made of ranges
+// of real units, possibly on different buses. A read of a virtual block is
+// cut into one read per range, all submitted at once so each bus serves its
+// share in parallel, then put back together in the client's transaction.
+// Parts go through mb_bus_submit() like any read, so the shadow map, the
+// cache, coalescing and splitting all apply.
+//
+#define VMAP_REQUESTS 8 // Virtual reads in progress
+#define VMAP_PARTS 32 // Reads to real units in progress
+
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_DATA_ADDRESS 0x02
+#define MB_EX_SLAVE_BUSY 0x06
+
+#define VMAP_REGS_MAX 125
+
+typedef struct vmap_req vmap_req_t;
+typedef struct vmap_part vmap_part_t;
+
+struct vmap_req {
+    vmap_req_t *next; // Free list
+    mb_bus_txn_t *t; // Client's transaction, receives the assembled answer
+    uint16_t count;
+    uint16_t pending; // Parts not back yet
+    uint8_t function;
+    uint8_t exception; // First part failure, 0 while none
+    vmap_part_t *parts; // Chained by next until they are submitted
+};
+
+struct vmap_part {
+    mb_bus_txn_t bus; // First, the done callback gets its address
+    vmap_part_t *next; // Free list
+    vmap_req_t *req;
+    uint16_t offset; // Registers into the virtual read
+    uint16_t count;
+};
+
+static mb_vmap_rule_t s_rules[MB_VMAP_MAX_RULES];
+static uint8_t s_virtual[256 / 8]; // Bitmap of unit IDs with at least one rule
+
+static vmap_req_t *s_free_reqs = NULL;
+static vmap_part_t *s_free_parts = NULL;
+static xSemaphoreHandle s_vmap_mutex = NULL;
+
+static mb_vmap_stats_t s_stats = { 0 };
+
+static void _update_virtual()
+{
+    memset(s_virtual, 0, sizeof(s_virtual));
+    for(int i=0; i<MB_VMAP_MAX_RULES; i++) {
+        if(s_rules[i].vuid != 0)
+            s_virtual[s_rules[i].vuid >> 3] |= (1 << (s_rules[i].vuid & 7));
+    }
+}
+
+static inline bool _is_virtual(uint8_t uid)
+{
+    return (s_virtual[uid >> 3] & (1 << (uid & 7))) != 0;
+}
+
+static inline void _exception(mb_bus_txn_t *t, uint8_t code)
+{
+    t->pdu[0] |= 0x80;
+    t->pdu[1] = code;
+    t->pdu_len = 2;
+}
+
+/* Called with the pool locked, gives back r and returns the client's transaction once every part is in */
+static mb_bus_txn_t *_req_release(vmap_req_t *r)
+{
+    if(--r->pending > 0)
+        return NULL;
+
+    mb_bus_txn_t *t = r->t;
+    t->pdu[0] = r->function;
+    if(r->exception)
+        _exception(t, r->exception);
+    else {
+        t->pdu[1] = r->count * 2;
+        t->pdu_len = 2 + r->count * 2;
+    }
+
+    r->next = s_free_reqs;
+    s_free_reqs = r;
+
+    return t;
+}
+
+static void _part_done(mb_bus_txn_t *bt)
+{
+    vmap_part_t *p = (vmap_part_t *)bt;
+    vmap_req_t *r = p->req;
+
+    xSemaphoreTake(s_vmap_mutex, portMAX_DELAY);
+
+    if(bt->pdu[0] == r->function && bt->pdu_len == 2 + p->count * 2)
+        memcpy(&r->t->pdu[2 + p->offset * 2], &bt->pdu[2], p->count * 2);
+    else if(r->exception == 0)
+        r->exception = (bt->pdu_len == 2 && (bt->pdu[0] & 0x80)) ? bt->pdu[1] : MB_EX_ILLEGAL_DATA_ADDRESS;
+
+    p->next = s_free_parts;
+    s_free_parts = p;
+
+    mb_bus_txn_t *t = _req_release(r);
+
+    xSemaphoreGive(s_vmap_mutex);
+
+    if(t)
+        t->done(t);
+}
+
+/* Rule covering virtual register reg of vuid, NULL if unmapped */
+static const mb_vmap_rule_t *_find_rule(uint8_t vuid, uint8_t function, uint16_t reg)
+{
+    for(int i=0; i<MB_VMAP_MAX_RULES; i++) {
+        const mb_vmap_rule_t *r = &s_rules[i];
+        if(r->vuid == vuid && r->function == function && reg >= r->vstart && (uint32_t)reg < (uint32_t)r->vstart + r->count)
+            return r;
+    }
+
+    return NULL;
+}
+
+bool mb_vmap_submit(mb_bus_txn_t *t)
+{
+    if(s_vmap_mutex == NULL || _is_virtual(t->uid) == false)
+        return false;
+
+    uint8_t function = t->pdu[0];
+    if(function != 3 && function != 4) {
+        _exception(t, MB_EX_ILLEGAL_FUNCTION);
+        t->done(t);
+        return true;
+    }
+
+    uint16_t start = (t->pdu[1] << 8) + t->pdu[2];
+    uint16_t count = (t->pdu[3] << 8) + t->pdu[4];
+    if(t->pdu_len != 5 || count < 1 || count > VMAP_REGS_MAX) {
+        _exception(t, MB_EX_ILLEGAL_DATA_ADDRESS);
+        t->done(t);
+        return true;
+    }
+
+    xSemaphoreTake(s_vmap_mutex, portMAX_DELAY);
+
+    vmap_req_t *r = s_free_reqs;
+    if(r == NULL) {
+        s_stats.requests++;
+        s_stats.busy++;
+        xSemaphoreGive(s_vmap_mutex);
+        _exception(t, MB_EX_SLAVE_BUSY);
+        t->done(t);
+        return true;
+    }
+    s_free_reqs = r->next;
+
+    /*
+     * The rules are walked under the lock, mbvmap edits them. Every register
+     * of the block must be mapped, and a part found for it, before anything is sent
+     */
+    uint8_t ex = 0;
+    int n = 0;
+    vmap_part_t **tail = &r->parts;
+    r->parts = NULL;
+    for(uint32_t reg = start; reg < (uint32_t)start + count; n++) {
+        const mb_vmap_rule_t *rule = _find_rule(t->uid, function, reg);
+        if(rule == NULL) {
+            ex = MB_EX_ILLEGAL_DATA_ADDRESS;
+            break;
+        }
+        vmap_part_t *p = s_free_parts;
+        if(p == NULL) {
+            ex = MB_EX_SLAVE_BUSY;
+            break;
+        }
+        s_free_parts = p->next;
+
+        uint32_t end = (uint32_t)rule->vstart + rule->count;
+        if(end > (uint32_t)start + count)
+            end = (uint32_t)start + count;
+
+        p->req = r;
+        p->offset = reg - start;
+        p->count = end - reg;
+
+        mb_bus_txn_t *bt = &p->bus;
+        uint16_t real = rule->start + (reg - rule->vstart);
+        bt->uid = rule->uid;
+        bt->pdu[0] = function;
+        bt->pdu[1] = real >> 8;
+        bt->pdu[2] = real & 0xff;
+        bt->pdu[3] = p->count >> 8;
+        bt->pdu[4] = p->count & 0xff;
+        bt->pdu_len = 5;
+
+        p->next = NULL;
+        *tail = p;
+        tail = &p->next;
+        reg = end;
+    }
+
+    if(ex) {
+        while(r->parts) {
+            vmap_part_t *p = r->parts;
+            r->parts = p->next;
+            p->next = s_free_parts;
+            s_free_parts = p;
+        }
+        r->next = s_free_reqs;
+        s_free_reqs = r;
+        if(ex == MB_EX_SLAVE_BUSY) {
+            s_stats.requests++;
+            s_stats.busy++;
+        }
+        xSemaphoreGive(s_vmap_mutex);
+        _exception(t, ex);
+        t->done(t);
+        return true;
+    }
+
+    r->t = t;
+    r->function = function;
+    r->count = count;
+    r->exception = 0;
+    r->pending = n + 1; /* Parts may complete while the others are submitted */
+
+    s_stats.requests++;
+    s_stats.parts += n;
+
+    vmap_part_t *p = r->parts;
+    r->parts = NULL;
+
+    xSemaphoreGive(s_vmap_mutex);
+
+    while(p) {
+        vmap_part_t *next = p->next; /* p goes back to the free list once answered */
+        mb_bus_txn_t *bt = &p->bus;
+        bt->client = t->client;
+        bt->done = _part_done;
+        bt->flags = t->flags;
+        mb_bus_submit(bt);
+        p = next;
+    }
+
+    xSemaphoreTake(s_vmap_mutex, portMAX_DELAY);
+    mb_bus_txn_t *done = _req_release(r);
+    xSemaphoreGive(s_vmap_mutex);
+
+    if(done)
+        done->done(done);
+
+    return true;
+}
+
+esp_err_t mb_vmap_init()
+{
+    s_vmap_mutex = xSemaphoreCreateMutex();
+
+    mb_vmap_load_config();
+
+    vmap_req_t *reqs = (vmap_req_t *)esp32_malloc(VMAP_REQUESTS * sizeof(vmap_req_t));
+    vmap_part_t *parts = (vmap_part_t *)esp32_malloc(VMAP_PARTS * sizeof(vmap_part_t));
+    if(reqs == NULL || parts == NULL) {
+        ESP_LOGE(TAG, "No memory for virtual unit requests");
+        return ESP_ERR_NO_MEM;
+    }
+
+    for(int i=0; i<VMAP_REQUESTS; i++) {
+        reqs[i].next = s_free_reqs;
+        s_free_reqs = &reqs[i];
+    }
+    for(int i=0; i<VMAP_PARTS; i++) {
+        parts[i].next = s_free_parts;
+        s_free_parts = &parts[i];
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t mb_vmap_set_rule(int index, const mb_vmap_rule_t *rule)
+{
+    if(index < 0 || index >= MB_VMAP_MAX_RULES)
+        return ESP_ERR_INVALID_ARG;
+
+    if(rule->vuid != 0) {
+        if((rule->function != 3 && rule->function != 4) || rule->count == 0 ||
+            (uint32_t)rule->vstart + rule->count > 0x10000 || (uint32_t)rule->start + rule->count > 0x10000)
+            return ESP_ERR_INVALID_ARG;
+        if(rule->uid == rule->vuid || _is_virtual(rule->uid)) /* Parts are read from real units only */
+            return ESP_ERR_INVALID_ARG;
+        for(int i=0; i<MB_VMAP_MAX_RULES; i++) {
+            if(i != index && s_rules[i].vuid != 0 && s_rules[i].uid == rule->vuid)
+                return ESP_ERR_INVALID_ARG; /* Already read from as a real unit */
+        }
+    }
+
+    xSemaphoreTake(s_vmap_mutex, portMAX_DELAY);
+    memcpy(&s_rules[index], rule, sizeof(mb_vmap_rule_t));
+    _update_virtual();
+    xSemaphoreGive(s_vmap_mutex);
+
+    return ESP_OK;
+}
+
+const mb_vmap_rule_t *mb_vmap_get_rule(int index)
+{
+    if(index < 0 || index >= MB_VMAP_MAX_RULES || s_rules[index].vuid == 0)
+        return NULL;
+    return &s_rules[index];
+}
+
+void mb_vmap_get_stats(mb_vmap_stats_t *stats)
+{
+    xSemaphoreTake(s_vmap_mutex, portMAX_DELAY);
+    memcpy(stats, &s_stats, sizeof(mb_vmap_stats_t));
+    xSemaphoreGive(s_vmap_mutex);
+}
+
+static nvs_handle my_nvs_handle;
+
+#define CMD_MB_VMAP "mb_vmap"
+
+void mb_vmap_load_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    size_t l = sizeof(s_rules);
+    err = nvs_get_blob(my_nvs_handle, CMD_MB_VMAP, s_rules, &l);
+    if(err != ESP_OK) {
+        ESP_LOGI(TAG, "No virtual unit map cached ...");
+    }
+
+    nvs_close(my_nvs_handle);
+
+    _update_virtual();
+}
+
+void mb_vmap_save_config()
+{
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_nvs_handle);
+    if(err != ESP_OK) {
+        ESP_LOGE(TAG, "Error (%d) opening NVS!\n", err);
+        return;
+    }
+
+    err = nvs_set_blob(my_nvs_handle, CMD_MB_VMAP, s_rules, sizeof(s_rules));
+    if(err != ESP_OK)
+        ESP_LOGE(TAG, "Fail save virtual unit map !!!");
+
+    nvs_commit(my_nvs_handle);
+    nvs_close(my_nvs_handle);
+}
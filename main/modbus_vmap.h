@@ -0,0 +1,49 @@
+#ifndef _MODBUS_VMAP_H
+#define _MODBUS_VMAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "modbus_bus.h"
+
+#define MB_VMAP_MAX_RULES 32
+
+typedef struct {
+    uint8_t vuid; /* Virtual unit ID, 0 when the rule is unused */
+    uint8_t function; /* 3 or 4 */
+    uint16_t vstart; /* First virtual register */
+    uint16_t count;
+    uint8_t uid; /* Unit the registers are read from */
+    uint16_t start;
+} mb_vmap_rule_t;
+
+typedef struct {
+    uint32_t requests;
+    uint32_t parts; /* Reads issued to the real units */
+    uint32_t busy; /* Answered 0x06, no part left */
+} mb_vmap_stats_t;
+
+esp_err_t mb_vmap_init();
+
+/* Serves t when t->uid is a virtual unit, t->done is called once every part is back */
+bool mb_vmap_submit(mb_bus_txn_t *t);
+
+esp_err_t mb_vmap_set_rule(int index, const mb_vmap_rule_t *rule); /* vuid 0 deletes */
+const mb_vmap_rule_t *mb_vmap_get_rule(int index); /* NULL if unused */
+
+void mb_vmap_get_stats(mb_vmap_stats_t *stats);
+
+void mb_vmap_load_config();
+void mb_vmap_save_config();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif